@@ -4,14 +4,24 @@
 #include <linux/spinlock.h>
 #include <linux/stddef.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
 #include <linux/slab.h>
 #include <linux/cs1550.h>
 
-//Macros to define global semaphore list and rwlock. Initialization of global semaphore ID
-static LIST_HEAD(sem_list);
-static DEFINE_RWLOCK(sem_rwlock);
+//Number of bits of the semaphore ID used to pick a bucket in the semaphore table, which has 2^SEM_HASH_BITS of them
+#define SEM_HASH_BITS 10
+
+//Macros to define global semaphore table and the lock that serializes changes to it. Initialization of global semaphore ID.
+//Lookups don't take the lock, they're done under RCU(See get_sem)
+static DEFINE_HASHTABLE(sem_table, SEM_HASH_BITS);
+static DEFINE_SPINLOCK(sem_table_lock);
 int semaphore_id = 0;
 
+static struct cs1550_sem *get_sem(long sem_id);
+static void put_sem(struct cs1550_sem *sem);
+
 /**
  * Creates a new semaphore. The long integer value is used to
  * initialize the semaphore's value.
@@ -26,32 +36,39 @@ int semaphore_id = 0;
  */
 SYSCALL_DEFINE1(cs1550_create, long, value)
 {
-	//Allocate memory for semaphore
-    struct cs1550_sem *sem = kmalloc(sizeof(struct cs1550_sem), GFP_ATOMIC);
+	struct cs1550_sem *sem = NULL;
+	long sem_id;
 
-	//Check if malloc returned null for the semaphore, also check if value is >= 0
-	if(sem == NULL)
+	//Check if value is >= 0 before allocating anything, so a bad value doesn't leak the semaphore
+	if(value < 0)
 	{
-		return -ENOMEM;
+		return -EINVAL;
 	}
-	else if(value < 0)
+
+	//Allocate memory for semaphore, and check if malloc returned null for it
+	sem = kmalloc(sizeof(struct cs1550_sem), GFP_ATOMIC);
+	if(sem == NULL)
 	{
-		return -EINVAL;
+		return -ENOMEM;
 	}
 
-	//Initialize semaphore ID, spinlock, value, and global semaphore list
-	sem->sem_id = semaphore_id;
+	//Initialize spinlock, value, and the semaphore's place in the global semaphore table. The table holds the first reference
     spin_lock_init(&sem->lock);
-	INIT_LIST_HEAD(&sem->list);
+	INIT_HLIST_NODE(&sem->node);
 	sem->value = value;
 	INIT_LIST_HEAD(&sem->waiting_tasks);
+	refcount_set(&sem->refs, 1);
+	sem->closed = 0;
 
-	//Lock data with RWlock before initializing and adding to the global semaphore list, as well as incrementing the semaphore ID
-	write_lock(&sem_rwlock);
-	list_add(&sem->list, &sem_list);
+	//Lock the table before assigning the semaphore ID and adding to the global semaphore table, as well as incrementing the semaphore ID.
+	//The ID is kept, since the semaphore can be closed as soon as the lock is dropped
+	spin_lock(&sem_table_lock);
+	sem_id = semaphore_id;
+	sem->sem_id = sem_id;
+	hash_add_rcu(sem_table, &sem->node, sem_id);
 	semaphore_id++;
-	write_unlock(&sem_rwlock);
-	return sem->sem_id;
+	spin_unlock(&sem_table_lock);
+	return sem_id;
 }
 
 /**
@@ -68,57 +85,59 @@ SYSCALL_DEFINE1(cs1550_create, long, value)
  */
 SYSCALL_DEFINE1(cs1550_down, long, sem_id)
 {
-	struct cs1550_sem *sem = NULL;
-	//Create read lock to protect access to global semaphore list
-	read_lock(&sem_rwlock);
-	list_for_each_entry(sem, &sem_list, list)
+	//Find the semaphore and hold a reference to it, so it stays around while we sleep on it
+	struct cs1550_sem *sem = get_sem(sem_id);
+	//No semaphore found matching the sem_id argument. Return -einval
+	if(sem == NULL)
+	{
+		return -EINVAL;
+	}
+
+	//Lock the spinlock before decrementing the value. A semaphore closed since we found it can't be waited on
+	spin_lock(&sem->lock);
+	if(sem->closed)
+	{
+		spin_unlock(&sem->lock);
+		put_sem(sem);
+		return -EINVAL;
+	}
+	sem->value--;
+	//If the value goes below 0, then the process needs to sleep
+	if(sem->value < 0)
 	{
-		//Loop through global semaphore list until we find one that matches the sem_id argument
-		if(sem->sem_id == sem_id)
+		//Allocate memory for a new task
+		struct cs1550_task *task_node = kmalloc(sizeof(struct cs1550_task), GFP_ATOMIC);
+		//If task node is still null then we are out of memory
+		if(task_node == NULL)
 		{
-			//Lock the spinlock before decrementing the value
-			spin_lock(&sem->lock);
-			sem->value--;
-			//If the value goes below 0, then the process needs to sleep
-			if(sem->value < 0)
-			{
-				//Allocate memory for a new task
-				struct cs1550_task *task_node = kmalloc(sizeof(struct cs1550_task), GFP_ATOMIC);
-				//If task node is still null then we are out of memory
-				if(task_node == NULL)
-				{
-					//Free locks and return -enomem
-					spin_unlock(&sem->lock);
-					read_unlock(&sem_rwlock);
-					return -ENOMEM;
-				}
-				//If allocation for the new task was successful, initialize the previous and next pointers
-				INIT_LIST_HEAD(&task_node->list);
-				//Add new task to the end of the queue
-				list_add_tail(&task_node->list, &sem->waiting_tasks);
-				//Initialize task's task struct pointer to the current task
-				task_node->task = current;
-				//Unlock the spinlock
-				spin_unlock(&sem->lock);
-				//Set the task state to no longer being ready and invoke the scheduler
-				set_current_state(TASK_INTERRUPTIBLE);
-				schedule();
-				//Once the scheduler has finished, unlock the read lock and return 0(success)
-				read_unlock(&sem_rwlock);
-				return 0;
-			}
-			else
-			{
-				//If the value is 0, then the process can run after unlocking the read and spin locks
-				spin_unlock(&sem->lock);
-				read_unlock(&sem_rwlock);
-				return 0;
-			}
+			//Give back the value we took, free locks and return -enomem
+			sem->value++;
+			spin_unlock(&sem->lock);
+			put_sem(sem);
+			return -ENOMEM;
 		}
+		//If allocation for the new task was successful, initialize the previous and next pointers
+		INIT_LIST_HEAD(&task_node->list);
+		//Add new task to the end of the queue
+		list_add_tail(&task_node->list, &sem->waiting_tasks);
+		//Initialize task's task struct pointer to the current task
+		task_node->task = current;
+		//Set the task state to no longer being ready before unlocking the spinlock, so an up() that comes in between
+		//isn't lost, then invoke the scheduler
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_unlock(&sem->lock);
+		schedule();
+		//Once the scheduler has finished, drop our reference and return 0(success)
+		put_sem(sem);
+		return 0;
+	}
+	else
+	{
+		//If the value is 0, then the process can run after unlocking the spin lock
+		spin_unlock(&sem->lock);
+		put_sem(sem);
+		return 0;
 	}
-	//No semaphore found matching the sem_id argument. Return -einval
-	read_unlock(&sem_rwlock);
-	return -EINVAL;
 }
 
 /**
@@ -135,42 +154,42 @@ SYSCALL_DEFINE1(cs1550_down, long, sem_id)
  */
 SYSCALL_DEFINE1(cs1550_up, long, sem_id)
 {
-	struct cs1550_sem *sem = NULL;
-	//Create read lock to protect access to global semaphore list
-	read_lock(&sem_rwlock);
-	list_for_each_entry(sem, &sem_list, list)
+	struct cs1550_sem *sem = get_sem(sem_id);
+	//No semaphore found matching the sem_id argument. Return -einval
+	if(sem == NULL)
 	{
-		//Loop through global semaphore list until we find one that matches the sem_id argument
-		if(sem->sem_id == sem_id)
-		{
-			//Lock the spinlock on the semaphore and increment it
-			spin_lock(&sem->lock);
-			sem->value++;
-			//If the value is <= 0, remove the first process from the queue and wake it up
-			if(sem->value <= 0)
-			{
-				//Get first entry in list
-				struct cs1550_task *temp_task = list_first_entry(&sem->waiting_tasks, struct cs1550_task, list);
-				//Delete entry from the semaphore task list
-				list_del(&temp_task->list);
-				//Wake up the task
-				wake_up_process(temp_task->task);
-				//Free memory after task has finished
-				kfree(temp_task);
-			}
-			spin_unlock(&sem->lock);
-			read_unlock(&sem_rwlock);
-			return 0;
-		}
+		return -EINVAL;
 	}
-	//No semaphore found matching the sem_id argument. Return -einval
-	read_unlock(&sem_rwlock);
-	return -EINVAL;
+
+	//Lock the spinlock on the semaphore and increment it, unless it was closed since we found it
+	spin_lock(&sem->lock);
+	if(sem->closed)
+	{
+		spin_unlock(&sem->lock);
+		put_sem(sem);
+		return -EINVAL;
+	}
+	sem->value++;
+	//If the value is <= 0, remove the first process from the queue and wake it up
+	if(sem->value <= 0)
+	{
+		//Get first entry in list
+		struct cs1550_task *temp_task = list_first_entry(&sem->waiting_tasks, struct cs1550_task, list);
+		//Delete entry from the semaphore task list
+		list_del(&temp_task->list);
+		//Wake up the task
+		wake_up_process(temp_task->task);
+		//Free memory after task has finished
+		kfree(temp_task);
+	}
+	spin_unlock(&sem->lock);
+	put_sem(sem);
+	return 0;
 }
 
 /**
  * Removes an already-created semaphore from the system-wide
- * semaphore list using the identifier obtained from a previous
+ * semaphore table using the identifier obtained from a previous
  * call to cs1550_create().
  *
  * Returns 0 when successful or -EINVAL if the semaphore ID is
@@ -178,37 +197,71 @@ SYSCALL_DEFINE1(cs1550_up, long, sem_id)
  */
 SYSCALL_DEFINE1(cs1550_close, long, sem_id)
 {
-	struct cs1550_sem *sem = NULL;
+	struct cs1550_sem *sem = get_sem(sem_id);
+	//Semaphore not found in table
+	if(sem == NULL)
+	{
+		return -EINVAL;
+	}
+
+	//Lock global semaphore table before removing from it, then protect access to semaphore's queue before checking if it is empty
+	spin_lock(&sem_table_lock);
+	spin_lock(&sem->lock);
+	//Check if the semaphore has any pending processes waiting on it, or was closed by someone else first
+	if(sem->closed || !list_empty(&sem->waiting_tasks))
+	{
+		//If waiting processes are found, we cannot close the semaphore
+		spin_unlock(&sem->lock);
+		spin_unlock(&sem_table_lock);
+		put_sem(sem);
+		return -EINVAL;
+	}
+
+	//Remove semaphore from global table if there are no pending processes. Anyone who found it already sees it's closed
+	sem->closed = 1;
+	hash_del_rcu(&sem->node);
+	spin_unlock(&sem->lock);
+	spin_unlock(&sem_table_lock);
+	//Drop our reference and the table's. The memory is freed once the last one is gone(See put_sem)
+	put_sem(sem);
+	put_sem(sem);
+	return 0;
+}
 
-	//Lock global semaphore list before traversal
-	write_lock(&sem_rwlock);
-	//Loop through global semaphore list
-	list_for_each_entry(sem, &sem_list, list) 
+/**
+ * Returns the semaphore with the given ID with a reference held on it,
+ * or NULL if there isn't one. Give the reference back with put_sem().
+ *
+ * Only the semaphores in the ID's bucket are looked at, so this takes
+ * the same time no matter how many semaphores exist. The table is read
+ * under RCU rather than a lock, so lookups from different CPUs don't
+ * write to any memory they share. A semaphore whose last reference is
+ * being dropped is treated as if it were already gone.
+ */
+static struct cs1550_sem *get_sem(long sem_id)
+{
+	struct cs1550_sem *sem = NULL;
+	rcu_read_lock();
+	hash_for_each_possible_rcu(sem_table, sem, node, sem_id)
 	{
-		//Attempt to remove semaphore if the id matches the id argument
-		if(sem->sem_id == sem_id)
+		if(sem->sem_id == sem_id && refcount_inc_not_zero(&sem->refs))
 		{
-			//Protect access to semaphore's queue before checking if it is empty
-			spin_lock(&sem->lock);
-			//Once the semaphore is found, check if it has any pending processes waiting on it
-			if(!list_empty(&sem->waiting_tasks))
-			{
-				//If waiting processes are found, we cannot close the semaphore
-				spin_unlock(&sem->lock);
-				write_unlock(&sem_rwlock);
-				return -EINVAL;
-			}
-
-			//Remove semaphore from global list if there are no pending processes
-			list_del(&sem->list);
-			spin_unlock(&sem->lock);
-			//Once removed from the list, free the memory allocated to the semaphore
-			kfree(sem);
-			write_unlock(&sem_rwlock);
-			return 0;
+			rcu_read_unlock();
+			return sem;
 		}
 	}
-	write_unlock(&sem_rwlock);
-	//Semaphore not found in list
-	return -EINVAL;
+	rcu_read_unlock();
+	return NULL;
+}
+
+/**
+ * Drops a reference to a semaphore. The last one frees it, once every
+ * CPU that could still be looking at it under RCU is done.
+ */
+static void put_sem(struct cs1550_sem *sem)
+{
+	if(refcount_dec_and_test(&sem->refs))
+	{
+		kfree_rcu(sem, rcu);
+	}
 }
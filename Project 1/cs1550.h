@@ -2,6 +2,8 @@
 #define _LINUX_CS1550_H
 
 #include <linux/list.h>
+#include <linux/refcount.h>
+#include <linux/types.h>
 
 /**
  * A generic semaphore, providing serialized signaling and
@@ -21,8 +23,17 @@ struct cs1550_sem
 	//Queue of tasks waiting on semaphore
 	struct list_head waiting_tasks;
 
-	//Global pointers to next/previous semaphores
-	struct list_head list;
+	//Links to the other semaphores in the same bucket of the global semaphore table
+	struct hlist_node node;
+
+	//References held by the global semaphore table and by calls using the semaphore. The last one frees it
+	refcount_t refs;
+
+	//Set, under lock, once the semaphore is removed from the table. Nothing can wait on it after that
+	int closed;
+
+	//Used to free the semaphore once no CPU can still be looking it up
+	struct rcu_head rcu;
 
 };
 
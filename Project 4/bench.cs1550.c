@@ -0,0 +1,252 @@
+//The handlers are called directly, so they're built in without the daemon's main
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#include <stdlib.h>
+
+//Files each benchmark works through unless -n says otherwise
+#define DEFAULT_COUNT 2000
+//Bytes each read and write moves
+#define IO_SIZE 4096
+
+//Calls to malloc, calloc and realloc so far. The Makefile links this with --wrap for each of them, so every call
+//goes through the __wrap_ functions below first
+static size_t num_allocs;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+
+static void run(const char *name, size_t count, int (*op)(size_t i));
+static int bench_mknod(size_t i);
+static int bench_getattr(size_t i);
+static int bench_getattr_missing(size_t i);
+static int bench_write(size_t i);
+static int bench_flush(size_t i);
+static int bench_read(size_t i);
+static int bench_readdir(size_t i);
+static int count_entry(void *buf, const char *name, const struct stat *statbuf, off_t offset);
+
+//Handlers being measured, which are the traced ones with -o trace
+static const struct fuse_operations *oper = &cs1550_oper;
+static char io_buf[IO_SIZE];
+
+/*
+ * Measures the handlers without mounting anything:
+ * bench.cs1550 [-n COUNT] [-o OPTIONS]
+ *
+ * A fresh image is made in a temporary directory, and the handlers are
+ * called on it directly, the way FUSE would call them but without the
+ * kernel in between. COUNT files are created in one directory, then looked
+ * up, looked up under names that aren't there, written, flushed and read
+ * back, a call per file, and the directory is listed. Each step prints the
+ * nanoseconds and the allocations(malloc, calloc or realloc) per call.
+ * -o takes the same options as the daemon, so the numbers can be compared
+ * with and without, say, -o log, or -o trace to see what tracing costs. The
+ * image and any trace are removed afterwards.
+ */
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1)
+	{
+		return 2;
+	}
+	size_t count = DEFAULT_COUNT;
+	for(int i = 1; i < args.argc; i++)
+	{
+		if(strcmp(args.argv[i], "-n") == 0 && i + 1 < args.argc && atoi(args.argv[i + 1]) > 0)
+		{
+			count = atoi(args.argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-n COUNT] [-o OPTIONS]\n", argv[0]);
+			return 2;
+		}
+	}
+	//The image is a hole until it's written, so room for every file costs nothing
+	if(!options.max_size)
+	{
+		options.max_size = "1G";
+	}
+
+	//.disk is made in a directory of its own, the same way mkfs.cs1550 makes it
+	char dir[] = "/tmp/cs1550-bench-XXXXXX";
+	if(!mkdtemp(dir) || chdir(dir) != 0)
+	{
+		fprintf(stderr, "%s: can't make a directory for the image: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+	int fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, BLOCK_SIZE) != 0)
+	{
+		fprintf(stderr, "%s: can't make an image in %s: %s\n", argv[0], dir, strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	//A trace goes next to the image, so it's cleaned up with it
+	if(options.trace)
+	{
+		options.trace = "bench.trace";
+		oper = &trace_oper;
+	}
+	struct fuse_conn_info conn;
+	memset(&conn, 0, sizeof(conn));
+	oper->init(&conn);
+	oper->mkdir("/bench", 0755);
+	memset(io_buf, 'x', sizeof(io_buf));
+
+	printf("%-16s %10s %12s %12s\n", "benchmark", "calls", "ns/call", "allocs/call");
+	run("mknod", count, bench_mknod);
+	run("getattr", count, bench_getattr);
+	run("getattr missing", count, bench_getattr_missing);
+	run("write", count, bench_write);
+	run("flush", count, bench_flush);
+	run("read", count, bench_read);
+	run("readdir", count / 100 > 10 ? count / 100 : 10, bench_readdir);
+
+	oper->destroy(NULL);
+	unlink(".disk");
+	unlink(".disk.crc");
+	unlink("bench.trace");
+	chdir("/");
+	rmdir(dir);
+	return 0;
+}
+
+/**
+	Call `op` for 0 to count - 1 and print how long each call took and how many allocations it made, on average.
+	Calls that fail are reported, since they don't measure what they were meant to
+**/
+static void run(const char *name, size_t count, int (*op)(size_t i))
+{
+	size_t num_failed = 0;
+	size_t allocs_before = num_allocs;
+	uint64_t before = trace_now();
+	for(size_t i = 0; i < count; i++)
+	{
+		num_failed += op(i) < 0;
+	}
+	uint64_t elapsed = trace_now() - before;
+	size_t allocs = num_allocs - allocs_before;
+
+	printf("%-16s %10zu %12.0f %12.2f", name, count, (double)elapsed / count, (double)allocs / count);
+	if(num_failed != 0)
+	{
+		printf("   (%zu failed)", num_failed);
+	}
+	printf("\n");
+}
+
+/**
+	Create file i
+**/
+static int bench_mknod(size_t i)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/bench/f%07zu", i);
+	return oper->mknod(path, 0644, 0);
+}
+
+/**
+	Look up file i
+**/
+static int bench_getattr(size_t i)
+{
+	char path[32];
+	struct stat statbuf;
+	snprintf(path, sizeof(path), "/bench/f%07zu", i);
+	return oper->getattr(path, &statbuf);
+}
+
+/**
+	Look up a name next to file i's that isn't there. Only -ENOENT counts as success
+**/
+static int bench_getattr_missing(size_t i)
+{
+	char path[32];
+	struct stat statbuf;
+	snprintf(path, sizeof(path), "/bench/m%07zu", i);
+	return oper->getattr(path, &statbuf) == -ENOENT ? 0 : -1;
+}
+
+/**
+	Write the start of file i
+**/
+static int bench_write(size_t i)
+{
+	char path[32];
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	snprintf(path, sizeof(path), "/bench/f%07zu", i);
+	return oper->write(path, io_buf, IO_SIZE, 0, &fi);
+}
+
+/**
+	Flush file i, placing the data buffered by its write
+**/
+static int bench_flush(size_t i)
+{
+	char path[32];
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	snprintf(path, sizeof(path), "/bench/f%07zu", i);
+	return oper->flush(path, &fi);
+}
+
+/**
+	Read back the start of file i
+**/
+static int bench_read(size_t i)
+{
+	char path[32];
+	char buf[IO_SIZE];
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	snprintf(path, sizeof(path), "/bench/f%07zu", i);
+	return oper->read(path, buf, IO_SIZE, 0, &fi);
+}
+
+/**
+	List the whole directory
+**/
+static int bench_readdir(size_t i)
+{
+	(void) i;
+	size_t num_entries = 0;
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	return oper->readdir("/bench", &num_entries, count_entry, 0, &fi);
+}
+
+/**
+	readdir's filler. Entries are only counted, there's nowhere for them to go
+**/
+static int count_entry(void *buf, const char *name, const struct stat *statbuf, off_t offset)
+{
+	(void) name;
+	(void) statbuf;
+	(void) offset;
+	(*(size_t*)buf)++;
+	return 0;
+}
+
+void * __wrap_malloc(size_t size)
+{
+	num_allocs++;
+	return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size)
+{
+	num_allocs++;
+	return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void *ptr, size_t size)
+{
+	num_allocs++;
+	return __real_realloc(ptr, size);
+}
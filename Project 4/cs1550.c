@@ -1,23 +1,519 @@
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
 
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #include "cs1550.h"
 
+struct block_io;
+struct dir_path;
+struct dentry_slot;
+struct negative_slot;
+struct block_buf;
+struct log_pass;
+
 //Helper functions
-static struct cs1550_directory_entry * find_dir_entry(char dir_name[]);
 static struct cs1550_file_entry * find_file(struct cs1550_directory_entry *, char file_name[], char extension[]);
+static struct cs1550_directory_entry * find_leaf(const char *dir, size_t dir_len, const char *file_name, const char *extension, struct dir_path *path);
+static void descend(struct dir_path *path, size_t level, const char *file_name, const char *extension, struct cs1550_directory_entry *leaf);
+static int next_leaf(struct dir_path *path, struct cs1550_directory_entry *leaf);
+static int compare_names(const char *fname, const char *fext, const char *key_fname, const char *key_fext);
+static void sort_leaf(struct cs1550_directory_entry *leaf);
+static int dir_insert(struct dir_path *path, struct cs1550_directory_entry *leaf, const struct cs1550_file_entry *entry);
+static int dir_insert_child(struct dir_path *path, size_t level, const struct cs1550_dir_key *key, size_t n_child);
+static int dir_remove(struct dir_path *path, struct cs1550_directory_entry *leaf, size_t n_file);
+static uint64_t name_prefix(const char *fname);
 static int check_path(const char *path);
+static int parse_path(const char *path, size_t *dir_len, char name[], char extension[]);
+static int split_name(const char *component, size_t len, char name[], char extension[]);
+static size_t lookup_dir(const char *path, size_t len);
+static size_t lookup_child(size_t n_parent, const char *name, size_t len);
+static int set_start_block(const char *dir, size_t dir_len, size_t n_new);
+static struct dentry_slot * dentry_slot(size_t n_parent, const char *name, size_t len);
+static void dentry_moved(size_t n_old, size_t n_new);
+static uint64_t name_hash(size_t n_dir, const char *name, size_t len);
+static struct negative_slot * negative_slot(size_t n_dir, const char *file_name, const char *extension);
+static int negative_cached(size_t n_dir, const char *file_name, const char *extension);
+static void negative_add(size_t n_dir, const char *file_name, const char *extension);
+static void negative_forget(size_t n_dir, const char *file_name, const char *extension);
 static int get_start_block(char dir_name[]);
+static void *block_buf_alloc(void);
+static void block_buf_free(void *buf);
+static void block_buf_drain(void *list);
+static void block_buf_make_key(void);
+static int read_block(size_t n_block, void *buf);
+static void write_block(size_t n_block, const void *buf);
+static void read_dir_block(size_t n_block, void *buf);
+static void fill_dir_stat(struct stat *statbuf);
+static void fill_file_stat(struct stat *statbuf, struct cs1550_file_entry *file);
+static size_t lookup_index_block(const char *path);
+static struct dirty_file * delalloc_find(size_t n_index_block);
+static struct cs1550_data_block * delalloc_lookup(size_t n_index_block, size_t entry);
+static struct cs1550_data_block * delalloc_buffer(size_t n_index_block, size_t entry);
+static int delalloc_flush(struct dirty_file *dirty);
+static void delalloc_flush_all(void);
+static void delalloc_drop(size_t n_index_block, size_t entry);
+static void *delalloc_buf_alloc(void);
+static void delalloc_buf_free(void *buf);
+static void free_file(size_t n_index_block);
+static void build_block_bitmap(void);
+static void mark_tree(const struct cs1550_root_directory *tree, int frozen);
+static void mark_dir_blocks(size_t n_block, size_t depth, size_t nesting, int frozen);
+static void mark_block_frozen(size_t n_block);
+static int block_frozen(size_t n_block);
+static int block_writable(size_t n_block);
+static int is_snapshot(const char *name);
+static size_t find_snapshot(const char *name);
+static int create_snapshot(const char *name);
+static int delete_snapshot(const char *name);
+static size_t copy_block(size_t n_block);
+static int cow_file(struct dir_path *path, struct cs1550_directory_entry *leaf, struct cs1550_file_entry *file);
+static int block_in_use(size_t n_block);
+static void mark_block_used(size_t n_block);
+static size_t blocks_available(void);
+static size_t alloc_blocks(size_t count);
+static size_t alloc_blocks_near(size_t count, size_t n_goal);
+static size_t dir_group_goal(void);
+static size_t data_goal(const struct cs1550_index_block *index, size_t n_index_block, size_t entry);
+static void free_block(size_t n_block);
+static void zero_blocks(size_t n_block, size_t count);
+static void trim_blocks(size_t n_block, size_t count);
+static void trim_free_space(void);
+static int grow_disk(size_t count);
+static void drop_cached_blocks(size_t n_block, size_t count);
+static unsigned char * page_cache_get(size_t n_page);
+static int open_disk(void);
+static void close_disk(void);
+static void unmap_disk(void);
+static size_t map_block(size_t n_block, off_t *offset);
+static int resize_disk(size_t n_blocks);
+static int fallocate_blocks(int mode, size_t n_block, size_t count);
+static int read_blocks(struct block_io *io, size_t count);
+static void read_run(int fd, struct iovec *iov, size_t n_iov, off_t offset);
+static void *read_image_blocks(void *arg);
+static void start_image_readers(void);
+static void stop_image_readers(void);
+static void *run_image_reader(void *arg);
+static size_t parse_size(const char *str);
+static size_t log_find_clean_segment(size_t n_segment);
+static size_t log_alloc(size_t count);
+static void log_clean(void);
+static int clean_segment(size_t n_segment);
+static size_t clean_dir_blocks(size_t n_block, size_t depth, size_t nesting, struct log_pass *pass);
+static unsigned int fragmentation_score(const struct cs1550_index_block *index);
+static void defrag_file(struct dir_path *path, struct cs1550_directory_entry *leaf, size_t n_file);
+static void checksum_open(void);
+static void checksum_close(void);
+static uint32_t block_checksum(const void *buf);
+static void checksum_store(size_t n_block, const void *buf);
+static int checksum_verify(size_t n_block, const void *buf);
+static void checksum_forget(size_t n_block, size_t count);
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len);
+static void trace_open(void);
+static void trace_close(void);
+static int trace_write_out(void);
+static uint64_t trace_now(void);
+static void trace_record(uint8_t op, const char *path, const char *path2, uint64_t offset, uint64_t size, uint32_t arg, int result, uint64_t time);
+#if defined(__x86_64__)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len);
+#endif
+
+//Where a file is, or would go, in a directory's B-tree: every block from the directory's first block down to
+//the directory block that holds it, and which child was followed in each node on the way
+struct dir_path
+{
+	//The directory's own path, which is the first dir_len characters of `dir`
+	const char *dir;
+	size_t dir_len;
+	//Number of nodes above the directory block, which is blocks[depth]
+	size_t depth;
+	size_t blocks[DIR_MAX_DEPTH + 1];
+	size_t slots[DIR_MAX_DEPTH];
+};
+
+//A block of a directory's B-tree, which is either a node or a directory block
+union dir_block
+{
+	struct cs1550_dir_node node;
+	struct cs1550_directory_entry dir;
+};
+
+//readdir offsets are made of the first COOKIE_PREFIX_LEN characters of a file name, followed by
+//COOKIE_COUNT_BITS bits counting how many files starting with them were listed(See cs1550_readdir)
+#define COOKIE_PREFIX_LEN 6
+#define COOKIE_COUNT_BITS 15
+
+//Number of directory blocks kept in memory. Sized so a listing followed by a
+//getattr per entry never has to go back to the disk for the directory block
+#define DIR_CACHE_SLOTS 32
+
+//One cached directory block, indexed by block number % DIR_CACHE_SLOTS
+struct dir_cache_slot
+{
+	size_t n_block;
+	int valid;
+	struct cs1550_directory_entry dir;
+};
+
+//Number of directories whose first block is kept in memory, so walking a path doesn't read a block per component
+#define DENTRY_CACHE_SLOTS 256
+//Longest name a path component can have: a name, a . and an extension
+#define MAX_COMPONENT (MAX_FILENAME + 1 + MAX_EXTENSION)
+
+//Where one directory starts, found by the first block of the directory it's in(0 for the root) and its name.
+//Indexed by a hash of both, and free when n_start_block is 0
+struct dentry_slot
+{
+	size_t n_parent;
+	char name[MAX_COMPONENT + 1];
+	size_t n_start_block;
+};
+
+//Number of names remembered as missing from a directory, so probing for them again reads nothing
+#define NEGATIVE_CACHE_SLOTS 256
+//Seconds the kernel remembers a name wasn't found for, so probing for it again doesn't even reach us
+#define NEGATIVE_TIMEOUT "1"
+
+//A name known not to be in a directory, found by the directory's first block. Indexed by a hash of both like the
+//dentry cache, and free when n_dir is 0. Names in the root aren't kept, since the root is always in memory
+struct negative_slot
+{
+	size_t n_dir;
+	char fname[MAX_FILENAME + 1];
+	char fext[MAX_EXTENSION + 1];
+};
+
+//Size and alignment of every read and write on the .disk file when it is opened with O_DIRECT. Blocks are
+//read and written a whole page at a time through the page cache below
+#define IO_ALIGN 4096
+#define BLOCKS_PER_PAGE (IO_ALIGN / BLOCK_SIZE)
+//Number of pages of the .disk file kept in memory in O_DIRECT mode
+#define PAGE_CACHE_SLOTS 256
+
+//One cached page of the .disk file, indexed by page number % PAGE_CACHE_SLOTS. `data` is IO_ALIGN
+//bytes, aligned to IO_ALIGN so it can be handed to O_DIRECT reads and writes as is
+struct page_cache_slot
+{
+	size_t n_page;
+	int valid;
+	unsigned char *data;
+};
+
+//Most image files a disk can be striped across
+#define MAX_IMAGES 16
+//Default number of consecutive blocks placed on one image before moving on to the next
+#define DEFAULT_STRIPE_UNIT 8
+//Most blocks read with a single preadv
+#define READ_RUN_MAX 64
+
+//One block to read and where to put it, see read_blocks
+struct block_io
+{
+	size_t n_block;
+	void *buf;
+};
+
+//The part of a read_blocks call handled by one image, possibly on its reader thread. `done` is set, under the
+//reader's lock, once it has been read
+struct image_read
+{
+	size_t n_image;
+	struct block_io *io;
+	size_t count;
+	int failed;
+	int done;
+	struct image_read *next;
+};
+
+//A thread that reads one image of a striped disk for read_blocks, started when the disk is opened. Reads are
+//queued for it under `lock`, `work` is signaled when one is queued and `done` when one is finished
+struct image_reader
+{
+	pthread_t thread;
+	int started;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct image_read *head;
+	struct image_read *tail;
+};
+
+//Most data blocks buffered across all files before they are placed on disk to free up memory
+#define DELALLOC_MAX_BLOCKS 256
+//Most files that can have buffered data at the same time
+#define DELALLOC_MAX_FILES 16
+//Buffers set aside for delalloc when the disk is mounted(See delalloc_buf_alloc). The limit is only checked after
+//a write, which buffers at most one index block's worth, so this is the most that can be buffered at once
+#define DELALLOC_BUFS (DELALLOC_MAX_BLOCKS + MAX_ENTRIES_IN_INDEX_BLOCK)
+
+//Data written to a file that hasn't been given blocks on disk yet. Slots are keyed by the file's
+//index block, and a slot with no pending blocks is free
+struct dirty_file
+{
+	size_t n_index_block;
+	size_t num_pending;
+	struct cs1550_data_block *pending[MAX_ENTRIES_IN_INDEX_BLOCK];
+};
+
+//Most free block buffers a thread keeps for reuse(See block_buf_alloc). Enough for what the handlers use at once.
+//Buffered data has buffers of its own(See DELALLOC_BUFS)
+#define BLOCK_BUF_POOL_MAX (2 * MAX_ENTRIES_IN_INDEX_BLOCK)
+
+//A free block buffer, linked to the next one through its own first bytes
+struct block_buf
+{
+	struct block_buf *next;
+};
+
+//Largest the .disk file grows to unless -o max_size is given. Matches the size of the image `make` used to create
+#define DEFAULT_MAX_DISK_SIZE (5 * 1024 * 1024)
+//Number of blocks the .disk file grows by at a time once it is full
+#define DISK_GROW_BLOCKS 2048
+//Number of blocks in an allocation group. Like FFS's cylinder groups, each directory in the root starts in one of
+//its own, and the blocks of its files are placed near the directory block they're in(See dir_group_goal)
+#define ALLOC_GROUP_BLOCKS 512
+
+//Fragmentation score(See fragmentation_score) a file opened for reading needs for -o defrag to lay it out again
+#define DEFAULT_DEFRAG_SCORE 25
+//Blocks defragmenting a file copies at a time, through a buffer on the stack
+#define DEFRAG_CHUNK_BLOCKS 16
+
+//Entries in the root whose name starts with this are snapshots rather than directories. They point to a frozen
+//copy of the root as it was when the snapshot was taken
+#define SNAPSHOT_PREFIX '@'
+
+//Blocks per segment in log mode. The log fills one segment at a time, and the cleaner empties whole segments
+#define LOG_SEGMENT_BLOCKS 64
+//Clean segments the cleaner tries to keep around for the log to move on to
+#define LOG_MIN_CLEAN_SEGMENTS 4
+//Most blocks a segment can have in use for the cleaner to empty it. Fuller segments cost more to move than they free
+#define LOG_CLEAN_MAX_LIVE (LOG_SEGMENT_BLOCKS * 3 / 4)
+//Most blocks cleaning a segment can move out of the way for one directory. Every block of the segment can take new
+//copies of an index block and of every block on its path through the directory and the ones it's nested in
+#define LOG_CLEAN_MAX_MOVES (LOG_SEGMENT_BLOCKS * (MAX_PATH_DEPTH * (DIR_MAX_DEPTH + 1) + 2))
+
+//Blocks in use in a log segment, how many of those belong to a snapshot, and whether the cleaner gave up on it.
+//Kept up to date along with the bitmap, so the cleaner never has to scan it
+struct log_segment
+{
+	size_t used;
+	size_t frozen;
+	int stuck;
+};
+
+//A block the cleaner wrote again at the head of the log, and where. The old block is freed once the root leads
+//to the new one, or the new one if the pass fails(See clean_segment)
+struct log_move
+{
+	size_t n_old;
+	size_t n_new;
+};
+
+//One directory's worth of cleaning: the segment being emptied, the blocks moved so far, and why it stopped
+struct log_pass
+{
+	size_t n_segment;
+	struct log_move *moves;
+	size_t num_moves;
+	int err;
+};
+
+//Reflected CRC32C(Castagnoli) polynomial, the one SSE4.2's crc32 instruction uses
+#define CRC32C_POLY 0x82F63B78
+
+//Identifies a trace file(See -o trace), and the version of its format
+#define TRACE_MAGIC "CS1550TR"
+#define TRACE_VERSION 1
+//Bytes of records kept in memory before they're written to the trace file
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+//Handlers a trace records calls to
+enum trace_op
+{
+	TRACE_GETATTR = 1,
+	TRACE_READDIR,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_MKNOD,
+	TRACE_UNLINK,
+	TRACE_RENAME,
+	TRACE_TRUNCATE,
+	TRACE_FLUSH,
+	TRACE_FSYNC,
+	TRACE_FALLOCATE,
+	TRACE_STATFS,
+	TRACE_OPEN,
+	TRACE_NUM_OPS
+};
+
+//Start of a trace file. Numbers are in the byte order of the machine that recorded it
+struct PACKED trace_header
+{
+	char magic[8];
+	uint32_t version;
+};
+
+//One call to a handler, followed by path_len bytes of the path it was given. rename's second path follows the
+//first after a 0 byte
+struct PACKED trace_record
+{
+	//Nanoseconds from the start of the trace to the call
+	uint64_t time;
+	uint64_t offset;
+	uint64_t size;
+	//Open flags, fsync's datasync, or fallocate's mode
+	uint32_t arg;
+	//What the handler returned
+	int32_t result;
+	uint8_t op;
+	uint16_t path_len;
+};
+
+//Mount options, set with -o on the command line
+struct cs1550_options
+{
+	//Largest the .disk file may grow to, e.g. "64M". Kept as a string so it can have a size suffix
+	char *max_size;
+
+	//Open the .disk file with O_DIRECT, so its blocks are only cached by us and not by the host as well
+	int odirect;
+
+	//Image files to stripe the disk across instead of .disk, separated by colons, e.g. "/ssd0/a.img:/ssd1/b.img"
+	char *stripe;
+
+	//Number of consecutive blocks placed on one image before moving on to the next
+	unsigned int stripe_unit;
+
+	//Move the blocks of fragmented files next to each other when they're opened for reading, and the
+	//fragmentation score that makes a file worth moving
+	int defrag;
+	unsigned int defrag_score;
+
+	//Keep a CRC32C checksum of every block in a file next to the disk image, and check blocks against it on read
+	int checksum;
+
+	//Mount this snapshot, read-only, instead of the live filesystem
+	char *snapshot;
+
+	//Never change blocks where they are. Everything that is written goes to the head of a log instead
+	int log;
+
+	//Record every call to a handler in this file, for replay.cs1550 to play back
+	char *trace;
+
+	//Mount read-only, with the image mapped from the host's page cache, so several daemons can serve the same
+	//image at once, each on as many threads as FUSE likes
+	int shared;
+};
+
+#define CS1550_OPT(t, p) { t, offsetof(struct cs1550_options, p), 1 }
+
+static struct fuse_opt cs1550_opts[] = {
+	CS1550_OPT("max_size=%s", max_size),
+	CS1550_OPT("odirect", odirect),
+	CS1550_OPT("stripe=%s", stripe),
+	CS1550_OPT("stripe_unit=%u", stripe_unit),
+	CS1550_OPT("defrag", defrag),
+	CS1550_OPT("defrag=", defrag),
+	CS1550_OPT("defrag=%u", defrag_score),
+	CS1550_OPT("checksum", checksum),
+	CS1550_OPT("trace=%s", trace),
+	CS1550_OPT("snapshot=%s", snapshot),
+	CS1550_OPT("log", log),
+	CS1550_OPT("shared", shared),
+	FUSE_OPT_END
+};
 
 //Root block
 struct cs1550_root_directory *root;
-//.disk file
-FILE *f;
+//Image files backing the disk. Usually just .disk, unless it is striped
+static int image_fds[MAX_IMAGES];
+static size_t num_images;
+//Each image mapped read-only with -o shared, and the size of each mapping
+static unsigned char *image_maps[MAX_IMAGES];
+static size_t image_map_sizes[MAX_IMAGES];
+//Reader thread of every image but the first on a striped disk(See read_blocks)
+static struct image_reader image_readers[MAX_IMAGES];
+//Blocks per stripe unit, and the number of blocks the disk's size is always a multiple of
+static size_t stripe_unit;
+static size_t disk_granularity;
+//Directory block cache
+static struct dir_cache_slot dir_cache[DIR_CACHE_SLOTS];
+//Dentry cache(See lookup_dir)
+static struct dentry_slot dentry_cache[DENTRY_CACHE_SLOTS];
+//Negative dentry cache(See negative_cached)
+static struct negative_slot negative_cache[NEGATIVE_CACHE_SLOTS];
+//Page cache used in O_DIRECT mode, and the aligned memory backing it
+static struct page_cache_slot page_cache[PAGE_CACHE_SLOTS];
+static unsigned char *page_cache_mem;
+//Files with buffered data, and the number of blocks buffered across all of them
+static struct dirty_file dirty_files[DELALLOC_MAX_FILES];
+static size_t delalloc_pending;
+//Free buffers for buffered data, and how many there are
+static struct block_buf *delalloc_bufs;
+static size_t num_delalloc_bufs;
+//Free block buffers of the calling thread, how many there are, and the key that frees them when the thread exits
+static __thread struct block_buf *block_bufs;
+static __thread size_t num_block_bufs;
+static pthread_key_t block_buf_key;
+static pthread_once_t block_buf_once = PTHREAD_ONCE_INIT;
+//Mount options
+static struct cs1550_options options;
+//Size of the .disk file in blocks, and the most blocks it is allowed to grow to
+static size_t total_blocks;
+static size_t max_blocks;
+//Free space bitmap, one bit per block with 1 meaning in use. Rebuilt from the directory tree on every mount
+static unsigned char *block_bitmap;
+static size_t free_blocks;
+//Number of files across every directory, kept up to date as they come and go so statfs doesn't have to walk the tree
+static size_t num_files;
+//Number of directories nested in other directories, kept the same way
+static size_t num_dirs;
+//Where the next search for free blocks without a goal starts
+static size_t alloc_cursor;
+//Free blocks in each allocation group, kept up to date along with the bitmap
+static size_t *group_free;
+//Blocks that belong to a snapshot, one bit per block like block_bitmap. They're never written or freed, the live
+//filesystem gets its own copy of one before changing it
+static unsigned char *frozen_bitmap;
+//Set when a snapshot is mounted, or with -o shared. Nothing on the disk may be changed
+static int read_only;
+//Next block the log writes to in log mode. Blocks in its segment can still be changed in place
+static size_t log_head;
+//Usage of every segment the disk can grow to, and how many of them have no blocks in use
+static struct log_segment *log_segments;
+static size_t log_clean_segments;
+//Blocks the cleaner moved, LOG_CLEAN_MAX_MOVES of them(See clean_segment). Allocated once on mount in log mode,
+//since it's too big for the stack and cleaning runs after every write
+static struct log_move *log_moves;
+//Checksum of every block with -o checksum, also kept in the checksum file crc_fd. 0 means the block has none yet
+static uint32_t *block_crcs;
+static int crc_fd = -1;
+//The CRC32C kernel, picked to suit the CPU, and the tables for the one that doesn't need SSE4.2
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *buf, size_t len);
+static uint32_t crc32c_table[8][256];
+//Trace file with -o trace, the records not written to it yet, and when it was started
+static int trace_fd = -1;
+static unsigned char *trace_buf;
+static size_t trace_len;
+static uint64_t trace_start;
 
 /**
  * Called whenever the system wants to know the file attributes, including
@@ -39,30 +535,29 @@ static int cs1550_getattr(const char *path, struct stat *statbuf)
 	// Check if the path is the root directory.
 	if (strcmp(path, "/") == 0) 
 	{
-		statbuf->st_mode = S_IFDIR | 0755;
-		statbuf->st_nlink = 2;
-
+		fill_dir_stat(statbuf);
 		return 0;
 	}
 
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	int size;
+	res = parse_path(path, &dir_len, filename, extension);
 
-	// Check if the path is a file.
+	// Check if the path is a file, or a directory in another directory.
 	if (res == 2 || res == 3) 
 	{
-		// Regular file
-		statbuf->st_mode = S_IFREG | 0666;
-	
-		// Only one hard link to this file
-		statbuf->st_nlink = 1;
+		//A name looked up before and not found is answered without reading the directory
+		size_t n_dir = lookup_dir(path, dir_len);
+		if(n_dir == 0 || negative_cached(n_dir, filename, extension))
+		{
+			return -ENOENT;
+		}
 
-		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
+		//Attempt to find the directory block the file would be in
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
 		if(!matching_directory)
 		{
 			return -ENOENT;
@@ -73,34 +568,50 @@ static int cs1550_getattr(const char *path, struct stat *statbuf)
 			struct cs1550_file_entry *matching_file = find_file(matching_directory, filename, extension);
 			if(!matching_file)
 			{
-				free(matching_directory);
+				negative_add(where.blocks[0], filename, extension);
+				block_buf_free(matching_directory);
 				return -ENOENT;
 			}
 			else
 			{
-				size = matching_file->fsize;
+				//Regular file, size taken from the directory entry
+				if(matching_file->fsize & FILE_IS_DIRECTORY)
+				{
+					fill_dir_stat(statbuf);
+				}
+				else
+				{
+					fill_file_stat(statbuf, matching_file);
+				}
 			}
 		}
 
-		// Determine the file size
-		statbuf->st_size = size;
-		free(matching_directory);
+		block_buf_free(matching_directory);
 		return 0; // no error
 	}
 
-	// Check if the path is a subdirectory.
+	// Check if the path is a subdirectory of the root.
 	if (res == 1) 
 	{
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
-		if(!matching_directory)
+		//Snapshots show up as empty directories
+		if(is_snapshot(filename))
+		{
+			if(find_snapshot(filename) == 0)
+			{
+				return -ENOENT;
+			}
+			fill_dir_stat(statbuf);
+			return 0;
+		}
+
+		//Directory attributes don't depend on its blocks, so it only has to be in the root
+		if(get_start_block(filename) == 0)
 		{
 			return -ENOENT;
 		}
 		else
 		{
-			statbuf->st_mode = S_IFDIR | 0755;
-			statbuf->st_nlink = 2;
-			free(matching_directory);
+			fill_dir_stat(statbuf);
 			return 0; // no error
 		}
 	}
@@ -116,7 +627,6 @@ static int cs1550_getattr(const char *path, struct stat *statbuf)
 static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			  off_t offset, struct fuse_file_info *fi)
 {
-	(void) offset;
 	(void) fi;
 
 	//Check if the path is valid
@@ -126,11 +636,11 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	}
 
 	//Parse data in
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	res = parse_path(path, &dir_len, filename, extension);
 
 	// Check path to find directory we are listing files in
 	if (strcmp(path, "/") == 0)
@@ -139,34 +649,97 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		filler(buf, ".", NULL, 0);
 		filler(buf, "..", NULL, 0);
 
-		// If we are at root, list all subdirectories
+		// If we are at root, list all subdirectories. Directory attributes
+		// don't depend on the directory block, so none need to be read
+		struct stat st;
+		fill_dir_stat(&st);
 		for (size_t i = 0; i < root->num_directories; i++) 
 		{
-			filler(buf, root->directories[i].dname, NULL, 0);
+			filler(buf, root->directories[i].dname, &st, 0);
 		}
 		return 0;
 	}
-	else if(res == 1)
+	else
 	{
-		// Add the current and parent directories no matter what
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
+		//Snapshots are only browsed by mounting them, so they're listed as empty
+		if(res == 1 && is_snapshot(filename))
+		{
+			if(find_snapshot(filename) == 0)
+			{
+				return -ENOENT;
+			}
+			filler(buf, ".", NULL, 0);
+			filler(buf, "..", NULL, 0);
+			return 0;
+		}
 
-		//If res = 1, then we are in a subdirectory and must list the files
-		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
+		//Files are listed in name order with an offset saying where to pick the listing back up, so a
+		//directory too big for one buffer is listed over several calls. The offset holds the start of the last
+		//listed name and how many files starting with it were listed(See name_prefix), which stays meaningful
+		//even if files were added or removed in between
+		uint64_t prefix = 0;
+		size_t skip = 0;
+		char start[MAX_FILENAME + 1] = "";
+		if(offset > 2)
+		{
+			prefix = (uint64_t)offset >> COOKIE_COUNT_BITS;
+			skip = offset & ((1 << COOKIE_COUNT_BITS) - 1);
+			for(size_t i = 0; i < COOKIE_PREFIX_LEN; i++)
+			{
+				start[i] = (prefix >> (8 * (COOKIE_PREFIX_LEN - 1 - i))) & 0xFF;
+			}
+		}
+
+		//Otherwise we are in a subdirectory and must list the files
+		//Attempt to find the directory block the listing starts in
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, strlen(path), start, "", &where);
 		if(!matching_directory)
 		{
-		
-			return -ENOENT;
+			//Return -ENOTDIR if the path is to a file
+			return lookup_index_block(path) ? -ENOTDIR : -ENOENT;
 		}
-		//If we find a match, list all files in the directory
-		else
+
+		// Add the current and parent directories no matter what
+		if(offset < 1 && filler(buf, ".", NULL, 1) != 0)
+		{
+			block_buf_free(matching_directory);
+			return 0;
+		}
+		if(offset < 2 && filler(buf, "..", NULL, 2) != 0)
+		{
+			block_buf_free(matching_directory);
+			return 0;
+		}
+
+		//Initialize an array for the filename + extension(If needed). Set the size to max filename + 1 char for . + max extension + 1 char for \0
+		char file[MAX_FILENAME + MAX_EXTENSION + 2];
+		//Attributes for each entry come straight from the directory block we already hold
+		struct stat st;
+		uint64_t last_prefix = 0;
+		size_t count = 0;
+		do
 		{
-			//Initialize an array for the filename + extension(If needed). Set the size to max filename + 1 char for . + max extension + 1 char for \0
-			char file[MAX_FILENAME + MAX_EXTENSION + 2];
+			//Directory blocks written before they were kept in order are sorted as they're read
+			sort_leaf(matching_directory);
 			for (size_t i = 0; i < matching_directory->num_files; i++) 
 			{
+				//Skip everything before the offset, and whatever starting with its prefix was already listed
+				uint64_t file_prefix = name_prefix(matching_directory->files[i].fname);
+				if(file_prefix != last_prefix)
+				{
+					last_prefix = file_prefix;
+					count = 0;
+				}
+				if(count < ((size_t)1 << COOKIE_COUNT_BITS) - 1)
+				{
+					count++;
+				}
+				if(file_prefix < prefix || (file_prefix == prefix && count <= skip))
+				{
+					continue;
+				}
+
 				//Copy the filename to the array
 				strncpy(file, matching_directory->files[i].fname, (MAX_FILENAME + 1));
 				//Check if file extension exists
@@ -178,18 +751,24 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 					strncat(file, matching_directory->files[i].fext, (MAX_EXTENSION + 1));
 				}
 				
-				//Write changes to buffer
-				filler(buf, file, NULL, 0);
+				//Write changes to buffer along with the file's attributes, stopping once it's full
+				if(matching_directory->files[i].fsize & FILE_IS_DIRECTORY)
+				{
+					fill_dir_stat(&st);
+				}
+				else
+				{
+					fill_file_stat(&st, &matching_directory->files[i]);
+				}
+				if(filler(buf, file, &st, (off_t)((file_prefix << COOKIE_COUNT_BITS) | count)) != 0)
+				{
+					block_buf_free(matching_directory);
+					return 0;
+				}
 			}
-			free(matching_directory);
-			return 0;
-			
-		}
-	}
-	else
-	{
-		//Return -ENOTDIR if the path is not to a directory
-		return -ENOTDIR;	
+		} while(next_leaf(&where, matching_directory));
+		block_buf_free(matching_directory);
+		return 0;
 	}
 }
 
@@ -200,9 +779,9 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 {
 	(void) mode;
 
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 	//Check if the path is valid
 	if(check_path(path) == 0)
 	{
@@ -210,24 +789,35 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 	}
 	
 
+	if(read_only)
+	{
+		return -EROFS;
+	}
+
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	res = parse_path(path, &dir_len, filename, extension);
 
-	//Ensure we are trying to make a directory in the root
+	//Check if we are trying to make a directory in the root
 	if (res == 1) 
 	{
 		//Loop through root directories and check if any of their names match the directory name.
 		//If so, return -EEXIST
 		for (size_t i = 0; i < root->num_directories; i++)
 		{
-			if (strcmp(directory, root->directories[i].dname) == 0)
+			if (strcmp(filename, root->directories[i].dname) == 0)
 			{
 				return -EEXIST;
 			}
 		}
 
-		//Ensure there is space for the new directory
-		if (root->num_directories >= MAX_DIRS_IN_ROOT)
+		//Making a directory whose name starts with SNAPSHOT_PREFIX takes a snapshot instead
+		if(is_snapshot(filename))
+		{
+			return create_snapshot(filename);
+		}
+
+		//Ensure there is space for the new directory, both in the root and on disk
+		if (root->num_directories >= MAX_DIRS_IN_ROOT || blocks_available() < 1)
 		{
 			return -ENOSPC;
 		}
@@ -235,22 +825,65 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 		{
 			//If the directory does not exist and there is space:
 			//Copy the new directory name into the next index
-			strncpy(root->directories[root->num_directories].dname, directory, (MAX_FILENAME + 1));
-			//Set the starting block of the new directory to the last allocated block
-			root->directories[root->num_directories].n_start_block = root->last_allocated_block + 1;
-			//Increment the # of directories and the last allocated block
+			strncpy(root->directories[root->num_directories].dname, filename, (MAX_FILENAME + 1));
+			//Allocate the directory block in an allocation group of its own and start it out empty
+			size_t n_start_block = alloc_blocks_near(1, dir_group_goal());
+			struct cs1550_directory_entry empty;
+			memset(&empty, 0, sizeof(struct cs1550_directory_entry));
+			write_block(n_start_block, &empty);
+			root->directories[root->num_directories].n_start_block = n_start_block;
+			//Increment the # of directories
 			root->num_directories++;
-			root->last_allocated_block++;
-			//Seek to start of file
-			fseek(f, 0, SEEK_SET);
 			//Write changes to root block and return success
-			fwrite(root, BLOCK_SIZE, 1, f);
+			write_block(0, root);
 			return 0;
 		}
 	}
+	else if(res == 2 || res == 3)
+	{
+		//Otherwise the directory goes in its parent like a file would, with an entry pointing to its first block
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
+		if(!matching_directory)
+		{
+			return -ENOENT;
+		}
+		if(find_file(matching_directory, filename, extension))
+		{
+			block_buf_free(matching_directory);
+			return -EEXIST;
+		}
+		if(blocks_available() < 1)
+		{
+			block_buf_free(matching_directory);
+			return -ENOSPC;
+		}
+
+		//Start the directory out empty before anything points to it
+		struct cs1550_file_entry entry;
+		memset(&entry, 0, sizeof(struct cs1550_file_entry));
+		strncpy(entry.fname, filename, (MAX_FILENAME + 1));
+		strncpy(entry.fext, extension, (MAX_EXTENSION + 1));
+		entry.fsize = FILE_IS_DIRECTORY;
+		entry.n_index_block = alloc_blocks_near(1, where.blocks[where.depth]);
+		struct cs1550_directory_entry empty;
+		memset(&empty, 0, sizeof(struct cs1550_directory_entry));
+		write_block(entry.n_index_block, &empty);
+
+		if(dir_insert(&where, matching_directory, &entry) != 0)
+		{
+			free_block(entry.n_index_block);
+			block_buf_free(matching_directory);
+			return -ENOSPC;
+		}
+		num_dirs++;
+		write_block(0, root);
+		block_buf_free(matching_directory);
+		return 0;
+	}
 
-	//Can't make directories in any place other than root
-	return -EPERM;
+	//The root already exists
+	return -EEXIST;
 }
 
 /**
@@ -261,24 +894,29 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	(void) mode;
 	(void) dev;
 
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 
 	//Check if the path is valid
 	if(check_path(path) == 0)
 	{
 		return -ENAMETOOLONG;
 	}
+	if(read_only)
+	{
+		return -EROFS;
+	}
 
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	res = parse_path(path, &dir_len, filename, extension);
 	
 	//Return an error if we didn't parse in 2 or 3 args
 	if (res == 2 || res == 3)
 	{
-		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
+		//Attempt to find the directory block the file goes in
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
 		if(!matching_directory)
 		{
 			return -ENOENT;
@@ -292,58 +930,42 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 			if(!matching_file)
 			{
 				//If there is enough space for the file, create it
-				if(matching_directory->num_files < MAX_FILES_IN_DIR)
+				if(blocks_available() >= 1)
 				{
-					//Get starting block of directory
-					int start_block = get_start_block(directory);
-
-					//Copy file data into the next free file
-					strncpy(matching_directory->files[matching_directory->num_files].fname, filename, (MAX_FILENAME + 1));
+					//Copy file data into a new entry
+					struct cs1550_file_entry entry;
+					memset(&entry, 0, sizeof(struct cs1550_file_entry));
+					strncpy(entry.fname, filename, (MAX_FILENAME + 1));
 					//Add extension to file if it exists
 					if(res == 3)
 					{
-						strncpy(matching_directory->files[matching_directory->num_files].fext, extension, (MAX_EXTENSION + 1));
+						strncpy(entry.fext, extension, (MAX_EXTENSION + 1));
 
 					}
-					matching_directory->files[matching_directory->num_files].fsize = 0;
-					matching_directory->files[matching_directory->num_files].n_index_block = root->last_allocated_block + 1;
+					entry.fsize = 0;
 
-					//Seek to and read the index block into a variable of type struct cs1550_index_block. Write the value of the last_allocated_block
-					// as the first entry in the index block array. Increment last_allocated_block for the first data block of the file
-					struct cs1550_index_block *index = malloc(sizeof(struct cs1550_index_block));
+					//Allocate an empty index block for the file near the directory block it's listed in, and write
+					//it before anything points to it. Data blocks are only placed once the file's data is
+					//flushed(See delalloc_flush), so a new file doesn't reserve one up front
+					entry.n_index_block = alloc_blocks_near(1, where.blocks[where.depth]);
+					struct cs1550_index_block *index = block_buf_alloc();
 					memset(index, 0, sizeof(struct cs1550_index_block));
-					//fseek to the directory block # by starting from 0 + index block * block size
-					fseek(f, ((root->last_allocated_block + 1) * BLOCK_SIZE), SEEK_SET);
-					//Read data into index block
-					fread(index, BLOCK_SIZE, 1, f);
-
-					//Increment last allocated block in root
-					root->last_allocated_block++;
-
-					//Allocate a block for the first data block as well
-					index->entries[0] = root->last_allocated_block + 1;
-
-					//Increment last_allocated_block again
-					root->last_allocated_block++;
-
-					//Increment the number of files in the directory
-					matching_directory->num_files++;
+					write_block(entry.n_index_block, index);
+					block_buf_free(index);
 
-					//Write changes to directory entry back to disk
-					fseek(f, start_block * BLOCK_SIZE, SEEK_SET);
-					fwrite(matching_directory, BLOCK_SIZE, 1, f);
+					//Add the file to its directory block, splitting it if it's full
+					if(dir_insert(&where, matching_directory, &entry) != 0)
+					{
+						free_block(entry.n_index_block);
+						block_buf_free(matching_directory);
+						return -ENOSPC;
+					}
+					num_files++;
 
 					//Write changes to root back to disk
-					fseek(f, 0, SEEK_SET);
-					fwrite(root, BLOCK_SIZE, 1, f);
+					write_block(0, root);
 
-					//Write changes to index block to disk
-					fseek(f, ((root->last_allocated_block - 1) * BLOCK_SIZE), SEEK_SET);
-					fwrite(index, BLOCK_SIZE, 1, f);
-
-					free(matching_directory);
-					free(matching_file);
-					free(index);
+					block_buf_free(matching_directory);
 					return 0;
 
 
@@ -351,14 +973,14 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 				//Return an error if there isn't enough space
 				else
 				{
-					free(matching_directory);
+					block_buf_free(matching_directory);
 					return -ENOSPC;
 				}
 			}
 			//If the file exists, return an error
 			else
 			{
-				free(matching_directory);
+				block_buf_free(matching_directory);
 				return -EEXIST;
 			}
 		}
@@ -377,9 +999,9 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 {
 	(void) fi;
 
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 
 	//Check if the path is valid
 	if(check_path(path) == 0)
@@ -388,12 +1010,13 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 	}
 
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	res = parse_path(path, &dir_len, filename, extension);
 	//Ensure path contains a path and file name
 	if(res == 2 || res == 3)
 	{
-		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
+		//Attempt to find the directory block the file would be in
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
 		if(!matching_directory)
 		{
 			return -ENOENT;
@@ -405,18 +1028,83 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 			if(!matching_file)
 			{
 				//Return an error if the file doesn't exist
-				free(matching_directory);
+				block_buf_free(matching_directory);
 				return -ENOENT;
 			}
+			else if(matching_file->fsize & FILE_IS_DIRECTORY)
+			{
+				//Directories have no data of their own
+				block_buf_free(matching_directory);
+				return -EISDIR;
+			}
 			else
 			{
+				//Don't read past the end of the file
+				if((size_t)offset >= matching_file->fsize || size == 0)
+				{
+					block_buf_free(matching_directory);
+					return 0;
+				}
+				if(offset + size > matching_file->fsize)
+				{
+					size = matching_file->fsize - offset;
+				}
+
+				//Nor past what one index block can address, in case the size on disk says otherwise
+				if((size_t)offset >= MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE)
+				{
+					block_buf_free(matching_directory);
+					return 0;
+				}
+				if(offset + size > MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE)
+				{
+					size = MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE - offset;
+				}
+
 				//Read the index block
-				struct cs1550_index_block *index = malloc(sizeof(struct cs1550_index_block));
-				fseek(f, (matching_file->n_index_block * BLOCK_SIZE), SEEK_SET);
-				fread(index, BLOCK_SIZE, 1, f);
+				struct cs1550_index_block *index = block_buf_alloc();
+				if(read_block(matching_file->n_index_block, index) != 0)
+				{
+					block_buf_free(index);
+					block_buf_free(matching_directory);
+					return -EIO;
+				}
 
-				//Read the data block
-				struct cs1550_data_block *data = malloc(sizeof(struct cs1550_data_block));
+				//Read every data block the request touches that is on disk in one go, so runs of blocks are read
+				//together and a striped disk can read from all of its images at once. Blocks the request covers
+				//completely go straight into buf. Only the first and last can be partly covered, and those are read
+				//into a buffer of their own and copied from below
+				size_t first = offset / BLOCK_SIZE;
+				size_t last = (offset + size - 1) / BLOCK_SIZE;
+				struct block_io io[MAX_ENTRIES_IN_INDEX_BLOCK];
+				struct cs1550_data_block *head = NULL;
+				struct cs1550_data_block *tail = NULL;
+				size_t num_io = 0;
+				for(size_t i = first; i <= last; i++)
+				{
+					if(index->entries[i] != 0)
+					{
+						io[num_io].n_block = index->entries[i];
+						if(i * BLOCK_SIZE < (size_t)offset || (i + 1) * BLOCK_SIZE > offset + size)
+						{
+							io[num_io].buf = i == first ? (head = block_buf_alloc()) : (tail = block_buf_alloc());
+						}
+						else
+						{
+							io[num_io].buf = buf + (i * BLOCK_SIZE - offset);
+						}
+						num_io++;
+					}
+				}
+				int err = read_blocks(io, num_io);
+				if(err != 0)
+				{
+					block_buf_free(head);
+					block_buf_free(tail);
+					block_buf_free(index);
+					block_buf_free(matching_directory);
+					return err;
+				}
 
 				size_t temp_size = 0;
 				while(temp_size != size)
@@ -428,45 +1116,44 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 					//Calculate the current offset to determine the data block to access
 					int curr_offset = (offset + temp_size) % BLOCK_SIZE;
 
-					//Calculate the amount of bytes to read for the current iteration
-					int curr_size = BLOCK_SIZE;
-					if((size - temp_size) < BLOCK_SIZE)
+					//Calculate the amount of bytes to read for the current iteration. Stop at the end of the block or the request
+					size_t curr_size = BLOCK_SIZE - curr_offset;
+					if((size - temp_size) < curr_size)
+					{
+						curr_size = size - temp_size;
+					}
+
+					if(index->entries[curr_index] != 0)
+					{
+						//Copy the data we read into the buffer, unless it was read there already
+						if(curr_size != BLOCK_SIZE)
+						{
+							memcpy(buf + temp_size, ((char*)(curr_index == (int)first ? head : tail)) + curr_offset, curr_size);
+						}
+					}
+					else
 					{
-						if((size - temp_size) + curr_offset > BLOCK_SIZE)
+						//No block on disk yet. The data is either still buffered waiting for allocation, or this is a hole
+						struct cs1550_data_block *pending = delalloc_lookup(matching_file->n_index_block, curr_index);
+						if(pending)
 						{
-							curr_size = BLOCK_SIZE - curr_offset;
+							memcpy(buf + temp_size, ((char*)pending) + curr_offset, curr_size);
 						}
 						else
 						{
-							curr_size = size - temp_size;
-
+							memset(buf + temp_size, 0, curr_size);
 						}
 					}
 
-					//If the index entry is empty, skip reading data
-					if(index->entries[curr_index] == 0)
-					{
-						temp_size += curr_size;
-						continue;
-					}
-					//Seek to current offset and read the block in
-					fseek(f, (index->entries[curr_index] * BLOCK_SIZE), SEEK_SET);
-					fread(data, BLOCK_SIZE, 1, f);
-
-					//Copy the data into the buffer
-					memcpy(buf + temp_size, ((char*)data) + curr_offset, curr_size);
-
 					//Increment the number of bytes copied
 					temp_size += curr_size;
 
 				}
 				
-				//if you need to read the next data block(s), retrieve the block number(s) from the index block
-				//(offset % block size) + size > remaining block size
-
-				free(matching_directory);
-				free(index);
-				free(data);
+				block_buf_free(matching_directory);
+				block_buf_free(index);
+				block_buf_free(head);
+				block_buf_free(tail);
 				return size;
 			}
 		}
@@ -485,23 +1172,28 @@ static int cs1550_write(const char *path, const char *buf, size_t size,
 {
 	(void) fi;
 
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 
 	//Check if the path is valid
 	if(check_path(path) == 0)
 	{
 		return -ENAMETOOLONG;
 	}
+	if(read_only)
+	{
+		return -EROFS;
+	}
 
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	res = parse_path(path, &dir_len, filename, extension);
 	//Ensure path contains a path and file name
 	if(res == 2 || res == 3)
 	{
-		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
+		//Attempt to find the directory block the file would be in
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
 		if(!matching_directory)
 		{
 			return -ENOENT;
@@ -513,19 +1205,53 @@ static int cs1550_write(const char *path, const char *buf, size_t size,
 			if(!matching_file)
 			{
 				//Return an error if the file doesn't exist
-				free(matching_directory);
+				block_buf_free(matching_directory);
 				return -ENOENT;
 			}
+			else if(matching_file->fsize & FILE_IS_DIRECTORY)
+			{
+				block_buf_free(matching_directory);
+				return -EISDIR;
+			}
 			else
 			{
+				//If the file is still part of a snapshot, or in log mode its blocks are behind the head of the log,
+				//give it directory and index blocks that can be changed first
+				if(cow_file(&where, matching_directory, matching_file) != 0)
+				{
+					block_buf_free(matching_directory);
+					return -ENOSPC;
+				}
+
+				//Files can't grow past what one index block can address
+				if((size_t)offset >= MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE)
+				{
+					block_buf_free(matching_directory);
+					return -EFBIG;
+				}
+				if(offset + size > MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE)
+				{
+					size = MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE - offset;
+				}
+
 				//Read the index block
-				struct cs1550_index_block *index = malloc(sizeof(struct cs1550_index_block));
-				fseek(f, (matching_file->n_index_block * BLOCK_SIZE), SEEK_SET);
-				fread(index, BLOCK_SIZE, 1, f);
+				struct cs1550_index_block *index = block_buf_alloc();
+				if(read_block(matching_file->n_index_block, index) != 0)
+				{
+					block_buf_free(index);
+					block_buf_free(matching_directory);
+					return -EIO;
+				}
 
 				//Read the data block
-				struct cs1550_data_block *data = malloc(sizeof(struct cs1550_data_block));
+				struct cs1550_data_block *data = block_buf_alloc();
 
+				//What to return if the write stops before anything is written
+				int err = -ENOSPC;
+				int index_dirty = 0;
+				//Blocks the new data was moved away from. They're freed once the index block stops pointing to them
+				size_t dead[MAX_ENTRIES_IN_INDEX_BLOCK];
+				size_t num_dead = 0;
 				size_t temp_size = 0;
 				while(temp_size != size)
 				{
@@ -536,58 +1262,77 @@ static int cs1550_write(const char *path, const char *buf, size_t size,
 					//Calculate the offset for the current data block
 					int curr_offset = (offset + temp_size) % BLOCK_SIZE;
 
-					//Calculate the amount of bytes to read for the current iteration
-					int curr_size = BLOCK_SIZE;
-					if((size - temp_size) < BLOCK_SIZE)
+					//Calculate the amount of bytes to write for the current iteration. Stop at the end of the block or the request
+					size_t curr_size = BLOCK_SIZE - curr_offset;
+					if((size - temp_size) < curr_size)
 					{
-						if((size - temp_size) + curr_offset > BLOCK_SIZE)
+						curr_size = size - temp_size;
+					}
+
+					if(index->entries[curr_index] != 0)
+					{
+						//The block already exists on disk, so update it in place. Don't write a new checksum over
+						//a block that is already corrupt
+						if(read_block(index->entries[curr_index], data) != 0)
 						{
-							curr_size = BLOCK_SIZE - curr_offset;
+							err = -EIO;
+							break;
 						}
-						else
-						{
-							curr_size = size - temp_size;
+						memcpy(((char*)data) + curr_offset, buf + temp_size, curr_size);
 
+						//A block that belongs to a snapshot has to stay as it is, and in log mode old blocks are
+						//never overwritten, so the new data goes to a new block
+						if(!block_writable(index->entries[curr_index]))
+						{
+							size_t n_copy = blocks_available() > 0 ? alloc_blocks_near(1, index->entries[curr_index]) : 0;
+							if(n_copy == 0)
+							{
+								break;
+							}
+							dead[num_dead++] = index->entries[curr_index];
+							index->entries[curr_index] = n_copy;
+							index_dirty = 1;
 						}
+						write_block(index->entries[curr_index], data);
 					}
-
-
-					//If the index entry is empty, attempt allocate a new block 
-					if(index->entries[curr_index] == 0)
+					else
 					{
-						//If there is space, allocate a new data block
-						index->entries[curr_index] = root->last_allocated_block + 1;
-
-						//Increment last_allocated_block again
-						root->last_allocated_block++;
-
-						//Write changes to root back to disk
-						fseek(f, 0, SEEK_SET);
-						fwrite(root, BLOCK_SIZE, 1, f);
-
-						//Write changes to index block to disk
-						fseek(f, (matching_file->n_index_block * BLOCK_SIZE), SEEK_SET);
-						fwrite(index, BLOCK_SIZE, 1, f);
-						
+						//Otherwise buffer the data in memory. Its block is only chosen when the file is flushed,
+						//so all of the file's new blocks can be placed next to each other
+						struct cs1550_data_block *pending = delalloc_buffer(matching_file->n_index_block, curr_index);
+						if(!pending)
+						{
+							//Out of space, stop with a short write
+							break;
+						}
+						memcpy(((char*)pending) + curr_offset, buf + temp_size, curr_size);
 					}
-					//Seek to and read the current data block in
-					fseek(f, (index->entries[curr_index] * BLOCK_SIZE), SEEK_SET);
-					fread(data, BLOCK_SIZE, 1, f);
-
-					//Copy buffer contents into the data block
-					memcpy(((char*)data) + curr_offset, buf + temp_size, curr_size);
-
-					//Write changes back to data block
-					fseek(f, (index->entries[curr_index] * BLOCK_SIZE), SEEK_SET);
-					fwrite(data, BLOCK_SIZE, 1, f);
 					 
 					//Increment the number of bytes copied
 					temp_size += curr_size;
 
 				}
 				
-				free(index);
-				free(data);
+				if(index_dirty)
+				{
+					write_block(matching_file->n_index_block, index);
+					write_block(0, root);
+				}
+				for(size_t i = 0; i < num_dead; i++)
+				{
+					free_block(dead[i]);
+				}
+				block_buf_free(index);
+				block_buf_free(data);
+
+				//Nothing could be written at all
+				if(temp_size == 0)
+				{
+					block_buf_free(matching_directory);
+					return err;
+				}
+				size = temp_size;
+
 				//Increment the file size and write the changes before returning
 				if(offset == 0)
 				{
@@ -596,14 +1341,23 @@ static int cs1550_write(const char *path, const char *buf, size_t size,
 					//in script 3
 					matching_file->fsize = size;
 				}
-				else
+				else if(offset + size > matching_file->fsize)
 				{
-					//If we aren't writing from the beginning, add to the size
-					matching_file->fsize += size;
+					//If we aren't writing from the beginning, the file only grows when we write past its end
+					matching_file->fsize = offset + size;
+				}
+				write_block(where.blocks[where.depth], matching_directory);
+				block_buf_free(matching_directory);
+
+				//Too much data buffered, place it on disk now
+				if(delalloc_pending > DELALLOC_MAX_BLOCKS)
+				{
+					delalloc_flush_all();
+				}
+				if(options.log)
+				{
+					log_clean();
 				}
-				fseek(f, (get_start_block(directory) * BLOCK_SIZE), SEEK_SET);
-				fwrite(matching_directory, BLOCK_SIZE, 1, f);
-				free(matching_directory);
 				return size;
 			}
 		}
@@ -619,11 +1373,9 @@ static int cs1550_write(const char *path, const char *buf, size_t size,
  */
 static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) fi;
-
-	char directory[MAX_FILENAME + 1];
+	size_t dir_len;
 	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char extension[MAX_EXTENSION + 1] = "";
 
 	//Check if the path is valid
 	if(check_path(path) == 0)
@@ -632,15 +1384,14 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
 	}
 
 	int res;
-	res = sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	res = parse_path(path, &dir_len, filename, extension);
 	
 
 	if(res == 1)
 	{
 		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
 		//If the directory isn't found return an error
-		if(!matching_directory)
+		if(get_start_block(filename) == 0)
 		{
 			return -ENOENT;
 		}
@@ -652,8 +1403,9 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
 	}
 	else if(res == 2 || res == 3)
 	{
-		//Attempt to find matching directory in the root block
-		struct cs1550_directory_entry *matching_directory = find_dir_entry(directory);
+		//Attempt to find the directory block the file would be in
+		struct dir_path where;
+		struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
 		if(!matching_directory)
 		{
 			return -ENOENT;
@@ -666,11 +1418,31 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
 			//If the file doesn't exist, return an error
 			if(!matching_file)
 			{
+				block_buf_free(matching_directory);
 				return -ENOENT;
 			}
+			//Directories in other directories can be opened too
+			else if(matching_file->fsize & FILE_IS_DIRECTORY)
+			{
+				block_buf_free(matching_directory);
+				return 0;
+			}
 			//If the file exists, return success
 			else
 			{
+				if(read_only && (fi->flags & O_ACCMODE) != O_RDONLY)
+				{
+					block_buf_free(matching_directory);
+					return -EROFS;
+				}
+
+				//Files opened only for reading are likely to be read more than written, so this is when
+				//laying a fragmented one out again pays off
+				if(options.defrag && !read_only && (fi->flags & O_ACCMODE) == O_RDONLY)
+				{
+					defrag_file(&where, matching_directory, matching_file - matching_directory->files);
+				}
+				block_buf_free(matching_directory);
 				return 0;
 			}
 		}
@@ -690,11 +1462,67 @@ static void *cs1550_init(struct fuse_conn_info *fi)
 {
 	(void) fi;
 	//Read in first disk block(root)
-	root = malloc(BLOCK_SIZE);
-	f = fopen(".disk", "rb+");
-	if (f != NULL)
+	root = calloc(1, BLOCK_SIZE);
+	read_only = options.snapshot != NULL || options.shared;
+	if (open_disk() == 0)
 	{
-		fread(root, BLOCK_SIZE, 1, f);
+		//The disk can grow up to its maximum size, in whole multiples of its granularity
+		max_blocks = (options.max_size ? parse_size(options.max_size) : DEFAULT_MAX_DISK_SIZE) / BLOCK_SIZE;
+		max_blocks -= max_blocks % disk_granularity;
+		if(max_blocks < total_blocks)
+		{
+			max_blocks = total_blocks;
+		}
+
+		checksum_open();
+		read_block(0, root);
+
+		//A snapshot is mounted by using its copy of the root in place of the real one
+		if(options.snapshot)
+		{
+			char name[MAX_FILENAME + 2];
+			snprintf(name, sizeof(name), "%c%s", SNAPSHOT_PREFIX, options.snapshot[0] == SNAPSHOT_PREFIX ? options.snapshot + 1 : options.snapshot);
+			size_t n_block = find_snapshot(name);
+			if(n_block != 0)
+			{
+				read_block(n_block, root);
+			}
+			else
+			{
+				fprintf(stderr, "cs1550: no snapshot named %s\n", name);
+				memset(root, 0, BLOCK_SIZE);
+			}
+		}
+
+		//Find out which blocks are in use, which also counts the files and directories for statfs
+		build_block_bitmap();
+
+		//Nothing is written on a read-only mount, so the disk can stay mounted read-write somewhere else
+		if(read_only)
+		{
+			return NULL;
+		}
+
+		//Give the space of the blocks that aren't in use back to the host
+		trim_free_space();
+
+		//Set aside the buffers for data that is written, so writes don't have to allocate them
+		for(size_t i = 0; i < DELALLOC_BUFS; i++)
+		{
+			void *buf = malloc(BLOCK_SIZE);
+			if(!buf)
+			{
+				break;
+			}
+			delalloc_buf_free(buf);
+		}
+
+		//Start the log in a clean segment past where the last mount left off
+		if(options.log)
+		{
+			log_head = log_find_clean_segment(alloc_cursor / LOG_SEGMENT_BLOCKS) * LOG_SEGMENT_BLOCKS;
+			log_moves = malloc(LOG_CLEAN_MAX_MOVES * sizeof(struct log_move));
+		}
 	}
 	return NULL;
 }
@@ -705,22 +1533,76 @@ static void *cs1550_init(struct fuse_conn_info *fi)
 static void cs1550_destroy(void *args)
 {
 	(void) args;
+	//Place any data that is still buffered before the disk goes away
+	delalloc_flush_all();
+	block_buf_drain(&delalloc_bufs);
+	num_delalloc_bufs = 0;
 	//Free the root node and close the .disk file
 	free(root);
-	fclose(f);
+	free(block_bitmap);
+	block_bitmap = NULL;
+	free(frozen_bitmap);
+	frozen_bitmap = NULL;
+	free(group_free);
+	group_free = NULL;
+	free(log_segments);
+	log_segments = NULL;
+	free(log_moves);
+	log_moves = NULL;
+	close_disk();
+	checksum_close();
+	//Nothing cached is valid for whatever disk is mounted next
+	memset(dir_cache, 0, sizeof(dir_cache));
+	memset(dentry_cache, 0, sizeof(dentry_cache));
+	memset(negative_cache, 0, sizeof(negative_cache));
+	free(page_cache_mem);
+	page_cache_mem = NULL;
+	memset(page_cache, 0, sizeof(page_cache));
+	block_buf_drain(&block_bufs);
 }
 
 /**
  * Called when close is called on a file descriptor, but because it might
  * have been dup'ed, this isn't a guarantee we won't ever need the file
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
+ * again. Any data still buffered for the file is given its blocks here.
  */
 static int cs1550_flush(const char *path, struct fuse_file_info *fi)
 {	
-	(void) path;
 	(void) fi;
-	// Success!
+	//Place the file's buffered data on disk
+	int res = delalloc_flush(delalloc_find(lookup_index_block(path)));
+	if(options.log && !read_only)
+	{
+		log_clean();
+	}
+	return res;
+}
+
+/**
+ * Called to synchronize a file's contents with the disk. Places the file's
+ * buffered data and then syncs the `.disk` file.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+	(void) fi;
+
+	int res = delalloc_flush(delalloc_find(lookup_index_block(path)));
+	if(res != 0)
+	{
+		return res;
+	}
+	for(size_t i = 0; i < num_images; i++)
+	{
+		if(fsync(image_fds[i]) != 0)
+		{
+			return -errno;
+		}
+	}
+	if(crc_fd >= 0 && fsync(crc_fd) != 0)
+	{
+		return -errno;
+	}
 	return 0;
 }
 
@@ -729,7 +1611,16 @@ static int cs1550_flush(const char *path, struct fuse_file_info *fi)
  */
 static int cs1550_rmdir(const char *path)
 {
-	(void) path;
+	if(read_only)
+	{
+		return -EROFS;
+	}
+
+	//Removing a snapshot frees every block only it was using
+	if(path[0] == '/' && is_snapshot(path + 1))
+	{
+		return delete_snapshot(path + 1);
+	}
 	return 0;
 }
 
@@ -743,7 +1634,7 @@ static int cs1550_truncate(const char *path, off_t size)
 {
 	(void) path;
 	(void) size;
-	return 0;
+	return read_only ? -EROFS : 0;
 }
 
 /**
@@ -752,168 +1643,3805 @@ static int cs1550_truncate(const char *path, off_t size)
 static int cs1550_unlink(const char *path)
 {
 	(void) path;
-	return 0;
+	return read_only ? -EROFS : 0;
 }
 
-/*
- * Register our new functions as the implementations of the syscalls.
- */
-static struct fuse_operations cs1550_oper = {
-	.getattr	= cs1550_getattr,
-	.readdir	= cs1550_readdir,
-	.mkdir		= cs1550_mkdir,
-	.rmdir		= cs1550_rmdir,
-	.read		= cs1550_read,
-	.write		= cs1550_write,
-	.mknod		= cs1550_mknod,
-	.unlink		= cs1550_unlink,
-	.truncate	= cs1550_truncate,
-	.flush		= cs1550_flush,
-	.open		= cs1550_open,
-	.init		= cs1550_init,
-	.destroy	= cs1550_destroy,
-};
-
-/*
- * Don't change this.
+/**
+ * Renames a file or directory. Only directory entries change: a file keeps its
+ * index block, and with it its data, so moving one costs the same whatever its
+ * size. A file that already has the new name is replaced and its blocks are
+ * freed. Directories keep their blocks the same way, wherever they move to,
+ * but can only be renamed to a name that isn't taken yet.
  */
-int main(int argc, char *argv[])
+static int cs1550_rename(const char *from, const char *to)
 {
-	return fuse_main(argc, argv, &cs1550_oper, NULL);
-}
+	size_t from_len;
+	char from_name[MAX_FILENAME + 1];
+	char from_ext[MAX_EXTENSION + 1] = "";
+	size_t to_len;
+	char to_name[MAX_FILENAME + 1];
+	char to_ext[MAX_EXTENSION + 1] = "";
 
-/**
-	Loop though the root block and return the starting block of the directory name requested
-**/
-static int get_start_block(char dir_name[])
-{
-	//Loop through root directories
-	for (size_t i = 0; i < root->num_directories; i++)
-	{ 
-		//Check if any of the directories match the requested one
-		if (strcmp(dir_name, root->directories[i].dname) == 0)
-		{
-			//Copy the starting block number into an int
-			return root->directories[i].n_start_block;
-		}
+	if(check_path(from) == 0 || check_path(to) == 0)
+	{
+		return -ENAMETOOLONG;
+	}
+	if(read_only)
+	{
+		return -EROFS;
+	}
+
+	int from_res = parse_path(from, &from_len, from_name, from_ext);
+	int to_res = parse_path(to, &to_len, to_name, to_ext);
+	if(from_res == 0 || to_res == 0)
+	{
+		return -EBUSY;
 	}
-	//If no match found, return null
-	return 0;
-}
 
+	//Snapshots can't be renamed, and nothing else can take a name that looks like one
+	if((from_res == 1 && is_snapshot(from_name)) || (to_res == 1 && is_snapshot(to_name)))
+	{
+		return -EPERM;
+	}
 
-/**
-	Loops through the root block and returns the directory entry matching the given name
-**/
-static struct cs1550_directory_entry * find_dir_entry(char dir_name[])
-{
-	//Loop through root directories
-	for (size_t i = 0; i < root->num_directories; i++)
-	{ 
-		//Check if any of the directories match the requested one
-		if (strcmp(dir_name, root->directories[i].dname) == 0)
+	//Renaming a directory in the root to another name in the root only changes its entry there
+	if(from_res == 1 && to_res == 1)
+	{
+		if(strcmp(from_name, to_name) == 0)
 		{
-			//Copy the starting block number into an int
-			int start = root->directories[i].n_start_block;
-			//Pointer to matching directory entry
-			struct cs1550_directory_entry *dir = malloc(sizeof(struct cs1550_directory_entry));
-			//fseek to the directory block # by starting from 0 + # of blocks * block size
-			fseek(f, start * BLOCK_SIZE, SEEK_SET);
-			//Read data into directory entry and return it
-			fread(dir, BLOCK_SIZE, 1, f);
-			return dir;
+			return get_start_block(from_name) ? 0 : -ENOENT;
+		}
+
+		size_t n_from = root->num_directories;
+		for(size_t i = 0; i < root->num_directories; i++)
+		{
+			if(strcmp(to_name, root->directories[i].dname) == 0)
+			{
+				return -EEXIST;
+			}
+			if(strcmp(from_name, root->directories[i].dname) == 0)
+			{
+				n_from = i;
+			}
 		}
+		if(n_from == root->num_directories)
+		{
+			return -ENOENT;
+		}
+		strncpy(root->directories[n_from].dname, to_name, (MAX_FILENAME + 1));
+		write_block(0, root);
+		dentry_moved(root->directories[n_from].n_start_block, 0);
+		return 0;
 	}
-	//If no match found, return null
-	return NULL;
-}
 
-/**
-	Loop through the files in the file entry and return a the matching file, if any
-**/
-static struct cs1550_file_entry * find_file(struct cs1550_directory_entry *dir, char file_name[], char extension[])
-{
-	
-	//Loop through all files in the directory
-	for (size_t i = 0; i < dir->num_files; i++)
+	//Find the entry being moved. A directory in the root is moved with the same kind of entry a directory in
+	//any other directory has
+	struct cs1550_file_entry moved;
+	memset(&moved, 0, sizeof(struct cs1550_file_entry));
+	struct dir_path from_path;
+	from_path.depth = 0;
+	if(from_res == 1)
 	{
-		//Check if the file names match
-		if((strcmp(file_name, dir->files[i].fname) == 0) && (strcmp(extension, dir->files[i].fext) == 0))
+		moved.fsize = FILE_IS_DIRECTORY;
+		moved.n_index_block = get_start_block(from_name);
+		if(moved.n_index_block == 0)
 		{
-			//If we have a match, return the file
-			return &(dir->files[i]);
-
+			return -ENOENT;
 		}
 	}
-	//If no match found, return null
-	return NULL;
-}
-
-/**
-	Loop through the path to ensure all arguments are the correct length
-**/
-static int check_path(const char *path)
-{
-	int valid_dir = 0;
-	int delimiter_index = 0;
-	int valid_file = 0;
-	//Loop through the directory portion of the path(1 to MAX_FILENAME + 2) and ensure it is proper length
-	for(int i = 1; i < (MAX_FILENAME + 2); i++)
+	else
 	{
-		//If we find a / character before exiting the loop then it is valid. Assign the index of the / character to our delimeter variable
-		if(path[i] == '/')
+		struct cs1550_directory_entry *src = find_leaf(from, from_len, from_name, from_ext, &from_path);
+		if(!src)
 		{
-			valid_dir = 1;
-			delimiter_index = i;
-			break;
+			return -ENOENT;
 		}
-		//If we find a null terminator before the max dir length, then the directory is also valid and we can return since the path has ended
-		else if(path[i] == '\0')
+		struct cs1550_file_entry *file = find_file(src, from_name, from_ext);
+		if(!file)
 		{
-			return 1;
-		}		
+			block_buf_free(src);
+			return -ENOENT;
+		}
+		moved = *file;
+		block_buf_free(src);
 	}
-
-	//Ensure the directory is valid before continuing
-	if(valid_dir == 0)
+	if(strcmp(from, to) == 0)
 	{
 		return 0;
 	}
+	int is_dir = (moved.fsize & FILE_IS_DIRECTORY) != 0;
 
-	//Loop from the index of the first / character until the max  filename length 
-	for(int i = delimiter_index + 1; i < (delimiter_index + MAX_FILENAME + 2); i++)
+	//A directory moved inside itself would be cut off from the root
+	size_t len = strlen(from);
+	if(is_dir && strncmp(from, to, len) == 0 && to[len] == '/')
 	{
-		//If we find a . character before exiting the loop then the filename is valid. Assign the index of the . character to the delimiter variable
-		if(path[i] == '.')
+		return -EINVAL;
+	}
+
+	if(to_res == 1)
+	{
+		//Only directories live in the root
+		if(!is_dir)
 		{
-			valid_file = 1;
-			delimiter_index = i;
-			break;
+			return -EPERM;
 		}
-		//If we find a null terminator before the max file length, then the file is valid and we can return since the path has ended
-		else if(path[i] == '\0')
+		if(get_start_block(to_name) != 0)
 		{
-			return 1;
+			return -EEXIST;
+		}
+		if(root->num_directories >= MAX_DIRS_IN_ROOT || blocks_available() < from_path.depth + 1)
+		{
+			return -ENOSPC;
 		}
+		memset(&root->directories[root->num_directories], 0, sizeof(struct cs1550_directory));
+		strncpy(root->directories[root->num_directories].dname, to_name, (MAX_FILENAME + 1));
+		root->directories[root->num_directories].n_start_block = moved.n_index_block;
+		root->num_directories++;
+		write_block(0, root);
 	}
-
-	//Ensure the filename is valid before continuing
-	if(valid_file == 0)
+	else
 	{
-		return 0;
+		memset(moved.fname, 0, sizeof(moved.fname));
+		memset(moved.fext, 0, sizeof(moved.fext));
+		strncpy(moved.fname, to_name, (MAX_FILENAME + 1));
+		strncpy(moved.fext, to_ext, (MAX_EXTENSION + 1));
+
+		struct dir_path to_path;
+		struct cs1550_directory_entry *dst = find_leaf(to, to_len, to_name, to_ext, &to_path);
+		if(!dst)
+		{
+			return -ENOENT;
+		}
+
+		//Files keep their place in name order, so the entry is added under its new name and the old one is
+		//removed afterwards, even within one directory. Make sure neither step can run out of space halfway:
+		//copying both paths and splitting every block on the new one is as bad as it gets
+		if(blocks_available() < (from_res == 1 ? 0 : from_path.depth + 1) + 2 * (to_path.depth + 2))
+		{
+			block_buf_free(dst);
+			return -ENOSPC;
+		}
+
+		//Move the entry over as is, index block and all. A file that already has the new name is replaced, but
+		//nothing can replace a directory or be replaced by one
+		struct cs1550_file_entry *target = find_file(dst, to_name, to_ext);
+		if(target && (is_dir || (target->fsize & FILE_IS_DIRECTORY)))
+		{
+			int err = !is_dir ? -EISDIR : (target->fsize & FILE_IS_DIRECTORY) ? -EEXIST : -ENOTDIR;
+			block_buf_free(dst);
+			return err;
+		}
+		if(target)
+		{
+			if(cow_file(&to_path, dst, NULL) != 0)
+			{
+				block_buf_free(dst);
+				return -ENOSPC;
+			}
+			target = find_file(dst, to_name, to_ext);
+			free_file(target->n_index_block);
+			*target = moved;
+			write_block(to_path.blocks[to_path.depth], dst);
+		}
+		else if(dir_insert(&to_path, dst, &moved) != 0)
+		{
+			block_buf_free(dst);
+			return -ENOSPC;
+		}
+		block_buf_free(dst);
 	}
 
-	//Loop from the index of the . until the end of the path
-	for(int i = delimiter_index + 1; i < (delimiter_index + MAX_EXTENSION + 2); i++)
+	//The new entry went to disk first. If we stop in between, the file is in both places rather than
+	//neither, which fsck untangles by giving one of them a copy. Adding the entry may have moved the old one
+	//to another directory block, so it's looked up again
+	if(from_res == 1)
 	{
-		//If we find a null terminator before the end of the path, then the extension is valid
-		if(path[i] == '\0')
+		for(size_t i = 0; i < root->num_directories; i++)
 		{
-			return 1;
+			if(strcmp(from_name, root->directories[i].dname) == 0)
+			{
+				memmove(&root->directories[i], &root->directories[i + 1], (root->num_directories - i - 1) * sizeof(struct cs1550_directory));
+				root->num_directories--;
+				memset(&root->directories[root->num_directories], 0, sizeof(struct cs1550_directory));
+				write_block(0, root);
+				break;
+			}
 		}
 	}
+	else
+	{
+		struct cs1550_directory_entry *src = find_leaf(from, from_len, from_name, from_ext, &from_path);
+		struct cs1550_file_entry *file = find_file(src, from_name, from_ext);
+		if(dir_remove(&from_path, src, file - src->files) != 0)
+		{
+			block_buf_free(src);
+			return -ENOSPC;
+		}
+		block_buf_free(src);
+	}
 
-	//If we don't see a null terminator before exiting the loop, then the extension is invalid
+	//A directory that moved is cached under its old name, and only directories in the root aren't counted
+	if(is_dir)
+	{
+		dentry_moved(moved.n_index_block, 0);
+		if(from_res == 1)
+		{
+			num_dirs++;
+		}
+		if(to_res == 1)
+		{
+			num_dirs--;
+		}
+	}
 	return 0;
+}
+
+/**
+ * Preallocates or deallocates space for a file. By default, every block in
+ * the range that doesn't exist yet is reserved as one contiguous run. The
+ * blocks read as zeros but no data is written to them. With
+ * FALLOC_FL_PUNCH_HOLE, the blocks in the range are given back instead,
+ * leaving a hole that reads as zeros.
+ */
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length,
+			    struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	size_t dir_len;
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1] = "";
+
+	//Check if the path is valid
+	if(check_path(path) == 0)
+	{
+		return -ENAMETOOLONG;
+	}
+
+	if(read_only)
+	{
+		return -EROFS;
+	}
+
+	//Only plain preallocation and punching holes are supported. Linux requires punching to keep the size
+	int punch = mode & FALLOC_FL_PUNCH_HOLE;
+	if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) || (punch && !(mode & FALLOC_FL_KEEP_SIZE)))
+	{
+		return -EOPNOTSUPP;
+	}
+	if(offset < 0 || length <= 0)
+	{
+		return -EINVAL;
+	}
 
-}
\ No newline at end of file
+	//Files can't grow past what one index block can address. There is nothing to punch past that either
+	off_t end = offset + length;
+	if(end > (off_t)(MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE))
+	{
+		if(!punch)
+		{
+			return -EFBIG;
+		}
+		end = MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE;
+		if(offset >= end)
+		{
+			return 0;
+		}
+	}
+
+	int res;
+	res = parse_path(path, &dir_len, filename, extension);
+	if(res != 2 && res != 3)
+	{
+		return -EISDIR;
+	}
+
+	//Attempt to find matching directory block and file
+	struct dir_path where;
+	struct cs1550_directory_entry *matching_directory = find_leaf(path, dir_len, filename, extension, &where);
+	if(!matching_directory)
+	{
+		return -ENOENT;
+	}
+	struct cs1550_file_entry *matching_file = find_file(matching_directory, filename, extension);
+	if(!matching_file)
+	{
+		block_buf_free(matching_directory);
+		return -ENOENT;
+	}
+	if(matching_file->fsize & FILE_IS_DIRECTORY)
+	{
+		block_buf_free(matching_directory);
+		return -EISDIR;
+	}
+	if(cow_file(&where, matching_directory, matching_file) != 0)
+	{
+		block_buf_free(matching_directory);
+		return -ENOSPC;
+	}
+
+	//A corrupt index block can't be trusted to say which blocks to free or zero
+	struct cs1550_index_block *index = block_buf_alloc();
+	if(read_block(matching_file->n_index_block, index) != 0)
+	{
+		block_buf_free(index);
+		block_buf_free(matching_directory);
+		return -EIO;
+	}
+	size_t first = offset / BLOCK_SIZE;
+	size_t last = (end - 1) / BLOCK_SIZE;
+	//Blocks partly zeroed in a copy. They're freed once the index block stops pointing to them
+	size_t dead[2];
+	size_t num_dead = 0;
+
+	if(punch)
+	{
+		struct cs1550_data_block *data = block_buf_alloc();
+		for(size_t i = first; i <= last; i++)
+		{
+			//Part of the block that falls inside the range
+			off_t block_start = (off_t)i * BLOCK_SIZE;
+			size_t from = offset > block_start ? offset - block_start : 0;
+			size_t to = end < block_start + BLOCK_SIZE ? end - block_start : BLOCK_SIZE;
+			struct cs1550_data_block *pending = delalloc_lookup(matching_file->n_index_block, i);
+
+			if(from == 0 && to == BLOCK_SIZE)
+			{
+				//The whole block is in the range, release it
+				if(index->entries[i] != 0)
+				{
+					free_block(index->entries[i]);
+					index->entries[i] = 0;
+				}
+				delalloc_drop(matching_file->n_index_block, i);
+			}
+			else if(index->entries[i] != 0)
+			{
+				//Only part of the block is, zero that part. If the block can't be changed where it is, zero a copy.
+				//A block that doesn't match its checksum is left as it is, rather than given a new one
+				if(read_block(index->entries[i], data) != 0)
+				{
+					continue;
+				}
+				memset(((char*)data) + from, 0, to - from);
+				if(!block_writable(index->entries[i]))
+				{
+					size_t n_copy = blocks_available() > 0 ? alloc_blocks_near(1, index->entries[i]) : 0;
+					if(n_copy == 0)
+					{
+						continue;
+					}
+					dead[num_dead++] = index->entries[i];
+					index->entries[i] = n_copy;
+				}
+				write_block(index->entries[i], data);
+			}
+			else if(pending)
+			{
+				memset(((char*)pending) + from, 0, to - from);
+			}
+		}
+		block_buf_free(data);
+	}
+	else
+	{
+		//Count the blocks in the range that don't exist yet, either on disk or buffered
+		size_t missing = 0;
+		for(size_t i = first; i <= last; i++)
+		{
+			if(index->entries[i] == 0 && !delalloc_lookup(matching_file->n_index_block, i))
+			{
+				missing++;
+			}
+		}
+		if(missing > blocks_available())
+		{
+			block_buf_free(index);
+			block_buf_free(matching_directory);
+			return -ENOSPC;
+		}
+
+		//Reserve them as one run if possible, otherwise one at a time, following the file's other blocks.
+		//Freshly reserved blocks might still hold old data if they were never freed properly, so they are
+		//zeroed without writing any data
+		size_t n_goal = data_goal(index, matching_file->n_index_block, first);
+		size_t run = alloc_blocks_near(missing, n_goal);
+		if(run != 0)
+		{
+			zero_blocks(run, missing);
+		}
+		for(size_t i = first; i <= last; i++)
+		{
+			if(index->entries[i] == 0 && !delalloc_lookup(matching_file->n_index_block, i))
+			{
+				if(run != 0)
+				{
+					index->entries[i] = run++;
+				}
+				else
+				{
+					index->entries[i] = alloc_blocks_near(1, n_goal);
+					zero_blocks(index->entries[i], 1);
+				}
+			}
+		}
+
+		//The file grows to cover the range unless asked not to
+		if(!(mode & FALLOC_FL_KEEP_SIZE) && (size_t)end > matching_file->fsize)
+		{
+			matching_file->fsize = end;
+			write_block(where.blocks[where.depth], matching_directory);
+		}
+	}
+
+	//Write changes to the index block and root back to disk
+	write_block(matching_file->n_index_block, index);
+	write_block(0, root);
+	for(size_t i = 0; i < num_dead; i++)
+	{
+		free_block(dead[i]);
+	}
+
+	block_buf_free(index);
+	block_buf_free(matching_directory);
+	return 0;
+}
+
+/**
+ * Reports the size of the filesystem and how much of it is free, for `df`.
+ * The disk counts as its maximum size, since it grows into that as blocks
+ * are needed. Blocks promised to buffered writes are free but not available.
+ * On a read-only mount nothing is free, and the file count is just the files
+ * and directories that are there.
+ */
+static int cs1550_statfs(const char *path, struct statvfs *statbuf)
+{
+	memset(statbuf, 0, sizeof(struct statvfs));
+	statbuf->f_bsize = BLOCK_SIZE;
+	statbuf->f_frsize = BLOCK_SIZE;
+	statbuf->f_blocks = max_blocks;
+	statbuf->f_bfree = free_blocks + (max_blocks - total_blocks);
+	statbuf->f_bavail = blocks_available();
+
+	//Directories have no limit on how many files they hold, so as many more files fit as there are blocks for
+	//their index blocks
+	statbuf->f_ffree = blocks_available();
+	statbuf->f_favail = statbuf->f_ffree;
+	statbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;
+
+	//A mounted snapshot can't take any more data
+	if(read_only)
+	{
+		statbuf->f_bfree = 0;
+		statbuf->f_bavail = 0;
+		statbuf->f_ffree = 0;
+		statbuf->f_favail = 0;
+		statbuf->f_flag |= ST_RDONLY;
+	}
+	statbuf->f_files = 1 + root->num_directories + num_dirs + num_files + statbuf->f_ffree;
+	return 0;
+}
+
+/*
+ * Register our new functions as the implementations of the syscalls.
+ */
+static struct fuse_operations cs1550_oper = {
+	.getattr	= cs1550_getattr,
+	.readdir	= cs1550_readdir,
+	.mkdir		= cs1550_mkdir,
+	.rmdir		= cs1550_rmdir,
+	.read		= cs1550_read,
+	.write		= cs1550_write,
+	.mknod		= cs1550_mknod,
+	.unlink		= cs1550_unlink,
+	.rename		= cs1550_rename,
+	.truncate	= cs1550_truncate,
+	.flush		= cs1550_flush,
+	.fsync		= cs1550_fsync,
+	.fallocate	= cs1550_fallocate,
+	.statfs		= cs1550_statfs,
+	.open		= cs1550_open,
+	.init		= cs1550_init,
+	.destroy	= cs1550_destroy,
+};
+
+/*
+ * With -o trace, FUSE calls these instead. Each one calls the handler it
+ * stands in for and records the call, along with what it returned, so
+ * nothing changes for the handlers themselves and there's no cost when
+ * tracing is off.
+ */
+static int trace_getattr(const char *path, struct stat *statbuf)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_getattr(path, statbuf);
+	trace_record(TRACE_GETATTR, path, NULL, 0, 0, 0, res, time);
+	return res;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_readdir(path, buf, filler, offset, fi);
+	trace_record(TRACE_READDIR, path, NULL, offset, 0, 0, res, time);
+	return res;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_mkdir(path, mode);
+	trace_record(TRACE_MKDIR, path, NULL, 0, 0, mode, res, time);
+	return res;
+}
+
+static int trace_rmdir(const char *path)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_rmdir(path);
+	trace_record(TRACE_RMDIR, path, NULL, 0, 0, 0, res, time);
+	return res;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_read(path, buf, size, offset, fi);
+	trace_record(TRACE_READ, path, NULL, offset, size, 0, res, time);
+	return res;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_write(path, buf, size, offset, fi);
+	trace_record(TRACE_WRITE, path, NULL, offset, size, 0, res, time);
+	return res;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_mknod(path, mode, dev);
+	trace_record(TRACE_MKNOD, path, NULL, 0, 0, mode, res, time);
+	return res;
+}
+
+static int trace_unlink(const char *path)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_unlink(path);
+	trace_record(TRACE_UNLINK, path, NULL, 0, 0, 0, res, time);
+	return res;
+}
+
+static int trace_rename(const char *from, const char *to)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_rename(from, to);
+	trace_record(TRACE_RENAME, from, to, 0, 0, 0, res, time);
+	return res;
+}
+
+static int trace_truncate(const char *path, off_t size)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_truncate(path, size);
+	trace_record(TRACE_TRUNCATE, path, NULL, 0, size, 0, res, time);
+	return res;
+}
+
+static int trace_flush(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_flush(path, fi);
+	trace_record(TRACE_FLUSH, path, NULL, 0, 0, 0, res, time);
+	return res;
+}
+
+static int trace_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_fsync(path, datasync, fi);
+	trace_record(TRACE_FSYNC, path, NULL, 0, 0, datasync, res, time);
+	return res;
+}
+
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_fallocate(path, mode, offset, length, fi);
+	trace_record(TRACE_FALLOCATE, path, NULL, offset, length, mode, res, time);
+	return res;
+}
+
+static int trace_statfs(const char *path, struct statvfs *statbuf)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_statfs(path, statbuf);
+	trace_record(TRACE_STATFS, path, NULL, 0, 0, 0, res, time);
+	return res;
+}
+
+static int trace_open_file(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t time = trace_now();
+	int res = cs1550_open(path, fi);
+	trace_record(TRACE_OPEN, path, NULL, 0, 0, fi->flags, res, time);
+	return res;
+}
+
+static void *trace_init(struct fuse_conn_info *fi)
+{
+	void *res = cs1550_init(fi);
+	trace_open();
+	return res;
+}
+
+static void trace_destroy(void *args)
+{
+	cs1550_destroy(args);
+	trace_close();
+}
+
+static struct fuse_operations trace_oper = {
+	.getattr	= trace_getattr,
+	.readdir	= trace_readdir,
+	.mkdir		= trace_mkdir,
+	.rmdir		= trace_rmdir,
+	.read		= trace_read,
+	.write		= trace_write,
+	.mknod		= trace_mknod,
+	.unlink		= trace_unlink,
+	.rename		= trace_rename,
+	.truncate	= trace_truncate,
+	.flush		= trace_flush,
+	.fsync		= trace_fsync,
+	.fallocate	= trace_fallocate,
+	.statfs		= trace_statfs,
+	.open		= trace_open_file,
+	.init		= trace_init,
+	.destroy	= trace_destroy,
+};
+
+#ifndef CS1550_NO_MAIN
+/*
+ * Our own -o options are pulled out of the arguments before the rest go to
+ * FUSE. Every handler works on the shared root block, block caches and
+ * buffered writes, so FUSE is told to handle requests one at a time (-s).
+ * With -o shared nothing is written or cached after the disk is mounted, so
+ * that's left out and requests are handled on several threads at once,
+ * unless they're being traced. The kernel is told the mount is read-only too.
+ * Nothing but this process changes the disk while it's mounted, so the
+ * kernel can also remember names that weren't found, the same way it does
+ * names that were. NEGATIVE_TIMEOUT goes before the user's arguments, so
+ * -o negative_timeout=0 still turns that off. replay.cs1550 builds this file
+ * with CS1550_NO_MAIN to call the handlers itself.
+ */
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1)
+	{
+		return 1;
+	}
+	if(!options.shared || options.trace)
+	{
+		fuse_opt_add_arg(&args, "-s");
+	}
+	if(options.shared)
+	{
+		fuse_opt_add_arg(&args, "-oro");
+	}
+	fuse_opt_insert_arg(&args, 1, "-onegative_timeout=" NEGATIVE_TIMEOUT);
+
+	int res = fuse_main(args.argc, args.argv, options.trace ? &trace_oper : &cs1550_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
+}
+#endif
+
+/**
+	Loop though the root block and return the starting block of the directory name requested
+**/
+static int get_start_block(char dir_name[])
+{
+	//Loop through root directories. Snapshots aren't directories
+	for (size_t i = 0; i < root->num_directories; i++)
+	{ 
+		//Check if any of the directories match the requested one
+		if (!is_snapshot(dir_name) && strcmp(dir_name, root->directories[i].dname) == 0)
+		{
+			//Copy the starting block number into an int
+			return root->directories[i].n_start_block;
+		}
+	}
+	//If no match found, return null
+	return 0;
+}
+
+
+/**
+	Loop through the files in the file entry and return a the matching file, if any
+**/
+static struct cs1550_file_entry * find_file(struct cs1550_directory_entry *dir, char file_name[], char extension[])
+{
+#if defined(__x86_64__)
+	//An entry starts with its name and extension as one fixed-width 13 byte key, so each entry is checked with a
+	//single 16 byte compare against the name laid out the same way. Only the bytes up to and including each
+	//terminator have to match, since whatever follows them in an entry doesn't count for strcmp either
+	size_t name_len = strnlen(file_name, MAX_FILENAME);
+	size_t ext_len = strnlen(extension, MAX_EXTENSION);
+	unsigned char key[16] = { 0 };
+	memcpy(key, file_name, name_len);
+	memcpy(key + MAX_FILENAME + 1, extension, ext_len);
+	unsigned int mask = ((1u << (name_len + 1)) - 1) | (((1u << (ext_len + 1)) - 1) << (MAX_FILENAME + 1));
+	__m128i want = _mm_loadu_si128((const __m128i*)key);
+	for(size_t i = 0; i < dir->num_files; i++)
+	{
+		__m128i have = _mm_loadu_si128((const __m128i*)&dir->files[i]);
+		if(((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(have, want)) & mask) == mask)
+		{
+			return &(dir->files[i]);
+		}
+	}
+	return NULL;
+#else
+	//Loop through all files in the directory
+	for (size_t i = 0; i < dir->num_files; i++)
+	{
+		//Check if the file names match
+		if((strcmp(file_name, dir->files[i].fname) == 0) && (strcmp(extension, dir->files[i].fext) == 0))
+		{
+			//If we have a match, return the file
+			return &(dir->files[i]);
+
+		}
+	}
+	//If no match found, return null
+	return NULL;
+#endif
+}
+
+/**
+	Compare a file's name and extension against another's, the way strcmp does. This is the order files are
+	kept in throughout a directory's B-tree
+**/
+static int compare_names(const char *fname, const char *fext, const char *key_fname, const char *key_fext)
+{
+	int cmp = strncmp(fname, key_fname, (MAX_FILENAME + 1));
+	if(cmp != 0)
+	{
+		return cmp;
+	}
+	return strncmp(fext, key_fext, (MAX_EXTENSION + 1));
+}
+
+/**
+	Find the directory block a file is in, or would go in if it doesn't exist yet, in the directory whose path is
+	the first dir_len characters of `dir`. Returns a copy of the block for the caller to free, with `path` filled
+	in with how it was reached, or null if there's no such directory
+**/
+static struct cs1550_directory_entry * find_leaf(const char *dir, size_t dir_len, const char *file_name, const char *extension, struct dir_path *path)
+{
+	size_t n_start_block = lookup_dir(dir, dir_len);
+	if(n_start_block == 0)
+	{
+		return NULL;
+	}
+	path->dir = dir;
+	path->dir_len = dir_len;
+	path->blocks[0] = n_start_block;
+	struct cs1550_directory_entry *leaf = block_buf_alloc();
+	descend(path, 0, file_name, extension, leaf);
+	return leaf;
+}
+
+/**
+	Walk the first len characters of a path one component at a time, from the root down, and return the first
+	block of the directory they lead to, or 0 if there's no such directory. Each step goes through the dentry
+	cache(See lookup_child), so a path walked recently is resolved without reading anything
+**/
+static size_t lookup_dir(const char *path, size_t len)
+{
+	size_t n_block = 0;
+	size_t pos = 0;
+	while(pos < len && path[pos] == '/')
+	{
+		const char *name = path + pos + 1;
+		size_t name_len = 0;
+		while(pos + 1 + name_len < len && name[name_len] != '/')
+		{
+			name_len++;
+		}
+		n_block = lookup_child(n_block, name, name_len);
+		if(n_block == 0)
+		{
+			return 0;
+		}
+		pos += 1 + name_len;
+	}
+	return n_block;
+}
+
+/**
+	Return the first block of the directory named by the len characters at `name`, in the directory starting at
+	block n_parent, or in the root if n_parent is 0. Returns 0 if there's no such directory. Directories found on
+	disk are added to the dentry cache, where the next lookup finds them
+**/
+static size_t lookup_child(size_t n_parent, const char *name, size_t len)
+{
+	if(len > MAX_COMPONENT)
+	{
+		return 0;
+	}
+	struct dentry_slot *slot = dentry_slot(n_parent, name, len);
+	if(slot->n_start_block != 0 && slot->n_parent == n_parent && strncmp(slot->name, name, len) == 0 && slot->name[len] == '\0')
+	{
+		return slot->n_start_block;
+	}
+
+	size_t n_child = 0;
+	if(n_parent == 0)
+	{
+		//Directories in the root keep their whole name in its entry. Snapshots aren't directories
+		for(size_t i = 0; i < root->num_directories; i++)
+		{
+			const char *dname = root->directories[i].dname;
+			if(!is_snapshot(dname) && strncmp(dname, name, len) == 0 && len <= MAX_FILENAME && dname[len] == '\0')
+			{
+				n_child = root->directories[i].n_start_block;
+				break;
+			}
+		}
+	}
+	else
+	{
+		//Deeper directories are entries in their parent's B-tree, like files
+		char fname[MAX_FILENAME + 1];
+		char fext[MAX_EXTENSION + 1];
+		if(split_name(name, len, fname, fext) != 0 || negative_cached(n_parent, fname, fext))
+		{
+			return 0;
+		}
+		struct dir_path where;
+		struct cs1550_directory_entry leaf;
+		where.blocks[0] = n_parent;
+		descend(&where, 0, fname, fext, &leaf);
+		struct cs1550_file_entry *entry = find_file(&leaf, fname, fext);
+		if(!entry)
+		{
+			negative_add(n_parent, fname, fext);
+		}
+		else if(entry->fsize & FILE_IS_DIRECTORY)
+		{
+			n_child = entry->n_index_block;
+		}
+	}
+
+	//With -o shared, handlers run on several threads at once, so nothing is cached that they'd all write to
+	if(n_child != 0 && !options.shared)
+	{
+		slot->n_parent = n_parent;
+		memcpy(slot->name, name, len);
+		slot->name[len] = '\0';
+		slot->n_start_block = n_child;
+	}
+	return n_child;
+}
+
+/**
+	Point the directory whose path is the first dir_len characters of `dir` to a new first block, n_new. Its entry
+	is either in the root or in the directory above it, whose blocks are copied first if they can't be changed
+	where they are(See cow_file). Returns 0, or -ENOSPC if there's no space for the copies
+**/
+static int set_start_block(const char *dir, size_t dir_len, size_t n_new)
+{
+	//The parent's path ends at the last / before the directory's name
+	size_t parent_len = dir_len - 1;
+	while(dir[parent_len] != '/')
+	{
+		parent_len--;
+	}
+	const char *name = dir + parent_len + 1;
+	size_t len = dir_len - parent_len - 1;
+	size_t n_old = 0;
+
+	if(parent_len == 0)
+	{
+		for(size_t i = 0; i < root->num_directories; i++)
+		{
+			const char *dname = root->directories[i].dname;
+			if(!is_snapshot(dname) && strncmp(dname, name, len) == 0 && len <= MAX_FILENAME && dname[len] == '\0')
+			{
+				n_old = root->directories[i].n_start_block;
+				root->directories[i].n_start_block = n_new;
+				write_block(0, root);
+				break;
+			}
+		}
+	}
+	else
+	{
+		char fname[MAX_FILENAME + 1];
+		char fext[MAX_EXTENSION + 1];
+		struct dir_path where;
+		struct cs1550_directory_entry *leaf = NULL;
+		if(split_name(name, len, fname, fext) == 0)
+		{
+			leaf = find_leaf(dir, parent_len, fname, fext, &where);
+		}
+		struct cs1550_file_entry *entry = leaf ? find_file(leaf, fname, fext) : NULL;
+		if(!entry)
+		{
+			block_buf_free(leaf);
+			return -ENOENT;
+		}
+		if(cow_file(&where, leaf, NULL) != 0)
+		{
+			block_buf_free(leaf);
+			return -ENOSPC;
+		}
+		n_old = entry->n_index_block;
+		entry->n_index_block = n_new;
+		write_block(where.blocks[where.depth], leaf);
+		block_buf_free(leaf);
+	}
+
+	dentry_moved(n_old, n_new);
+	return 0;
+}
+
+/**
+	Return the dentry cache slot for the directory with the given name in the directory starting at n_parent
+**/
+static struct dentry_slot * dentry_slot(size_t n_parent, const char *name, size_t len)
+{
+	return &dentry_cache[name_hash(n_parent, name, len) % DENTRY_CACHE_SLOTS];
+}
+
+/**
+	Keep the dentry cache right when a directory's first block changes from n_old to n_new, or, with n_new 0, when
+	the directory is no longer where it was cached. Directories cached under it were found by its old block, which
+	may be handed out again, so they're dropped
+**/
+static void dentry_moved(size_t n_old, size_t n_new)
+{
+	if(n_old == 0)
+	{
+		return;
+	}
+	for(size_t i = 0; i < DENTRY_CACHE_SLOTS; i++)
+	{
+		struct dentry_slot *slot = &dentry_cache[i];
+		if(slot->n_start_block == n_old)
+		{
+			slot->n_start_block = n_new;
+		}
+		else if(slot->n_parent == n_old)
+		{
+			slot->n_start_block = 0;
+		}
+	}
+	for(size_t i = 0; i < NEGATIVE_CACHE_SLOTS; i++)
+	{
+		if(negative_cache[i].n_dir == n_old)
+		{
+			negative_cache[i].n_dir = 0;
+		}
+	}
+}
+
+/**
+	FNV-1a hash of a directory's first block and a name in it, which places both the dentry cache's and the
+	negative dentry cache's entries
+**/
+static uint64_t name_hash(size_t n_dir, const char *name, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < sizeof(size_t); i++)
+	{
+		hash = (hash ^ ((n_dir >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+	}
+	for(size_t i = 0; i < len; i++)
+	{
+		hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+	Return the negative dentry cache slot for a file name and extension in the directory starting at n_dir
+**/
+static struct negative_slot * negative_slot(size_t n_dir, const char *file_name, const char *extension)
+{
+	char name[MAX_COMPONENT + 1];
+	int len = snprintf(name, sizeof(name), "%s.%s", file_name, extension);
+	return &negative_cache[name_hash(n_dir, name, len) % NEGATIVE_CACHE_SLOTS];
+}
+
+/**
+	Check if a name is known not to be in the directory starting at n_dir. Misses are remembered by negative_add
+	and forgotten by negative_forget whenever something with the name is added, so build tools and shells probing
+	for files that aren't there get their answer without a single block being read
+**/
+static int negative_cached(size_t n_dir, const char *file_name, const char *extension)
+{
+	struct negative_slot *slot = negative_slot(n_dir, file_name, extension);
+	return n_dir != 0 && slot->n_dir == n_dir && strcmp(slot->fname, file_name) == 0 && strcmp(slot->fext, extension) == 0;
+}
+
+/**
+	Remember that a name isn't in the directory starting at n_dir
+**/
+static void negative_add(size_t n_dir, const char *file_name, const char *extension)
+{
+	//Handlers run on several threads with -o shared(See lookup_child)
+	if(options.shared)
+	{
+		return;
+	}
+	struct negative_slot *slot = negative_slot(n_dir, file_name, extension);
+	slot->n_dir = n_dir;
+	strncpy(slot->fname, file_name, MAX_FILENAME + 1);
+	strncpy(slot->fext, extension, MAX_EXTENSION + 1);
+}
+
+/**
+	Forget that a name isn't in the directory starting at n_dir, since it's about to be
+**/
+static void negative_forget(size_t n_dir, const char *file_name, const char *extension)
+{
+	if(negative_cached(n_dir, file_name, extension))
+	{
+		negative_slot(n_dir, file_name, extension)->n_dir = 0;
+	}
+}
+
+/**
+	Follow a directory's B-tree down from path->blocks[level] to the directory block a file belongs in, or the
+	first one if file_name is null. The rest of `path` is filled in on the way and the directory block is copied
+	into `leaf`. A node that doesn't make sense is read as an empty directory block, so a corrupt one can't send
+	us anywhere
+**/
+static void descend(struct dir_path *path, size_t level, const char *file_name, const char *extension, struct cs1550_directory_entry *leaf)
+{
+	union dir_block block;
+	read_dir_block(path->blocks[level], &block);
+	while(block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		size_t num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+		if(level >= DIR_MAX_DEPTH || num_keys > MAX_KEYS_IN_DIR_NODE)
+		{
+			memset(&block, 0, sizeof(union dir_block));
+			break;
+		}
+
+		//Each key is the first name in the child to its right
+		size_t slot = 0;
+		while(file_name && slot < num_keys && compare_names(file_name, extension, block.node.keys[slot].fname, block.node.keys[slot].fext) >= 0)
+		{
+			slot++;
+		}
+		path->slots[level] = slot;
+		path->blocks[level + 1] = block.node.children[slot];
+		level++;
+		read_dir_block(path->blocks[level], &block);
+	}
+	path->depth = level;
+	memcpy(leaf, &block.dir, sizeof(struct cs1550_directory_entry));
+}
+
+/**
+	Move `path` on to the next directory block in name order and copy that block into `leaf`. Returns 1, or 0
+	if `path` was already at the directory's last block
+**/
+static int next_leaf(struct dir_path *path, struct cs1550_directory_entry *leaf)
+{
+	union dir_block block;
+	//Go up to the first node that has a child to the right of the one we came from, then down its left side
+	for(size_t level = path->depth; level-- > 0;)
+	{
+		read_dir_block(path->blocks[level], &block);
+		if(path->slots[level] < (block.node.num_keys & ~DIR_NODE_INTERIOR))
+		{
+			path->slots[level]++;
+			path->blocks[level + 1] = block.node.children[path->slots[level]];
+			descend(path, level + 1, NULL, NULL, leaf);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+	Put the files of a directory block in name order. Directory blocks are kept in order, except ones written
+	before they had to be, which are only ever a directory's single block
+**/
+static void sort_leaf(struct cs1550_directory_entry *leaf)
+{
+	for(size_t i = 1; i < leaf->num_files && i < MAX_FILES_IN_DIR; i++)
+	{
+		struct cs1550_file_entry file = leaf->files[i];
+		size_t j = i;
+		while(j > 0 && compare_names(file.fname, file.fext, leaf->files[j - 1].fname, leaf->files[j - 1].fext) < 0)
+		{
+			leaf->files[j] = leaf->files[j - 1];
+			j--;
+		}
+		leaf->files[j] = file;
+	}
+}
+
+/**
+	Add a file to the directory block at the end of `path`, `leaf` being the caller's copy of it, keeping its
+	files in name order. A full directory block is split in two, which adds a child to the node above it, and
+	so on up the tree(See dir_insert_child). Returns 0, or -ENOSPC if there's no space for the new blocks
+**/
+static int dir_insert(struct dir_path *path, struct cs1550_directory_entry *leaf, const struct cs1550_file_entry *entry)
+{
+	negative_forget(path->blocks[0], entry->fname, entry->fext);
+
+	//At worst every block on the path is split and a new node goes on top
+	if(cow_file(path, leaf, NULL) != 0 || blocks_available() < path->depth + 2)
+	{
+		return -ENOSPC;
+	}
+
+	//Lay the files out in order with the new one among them
+	sort_leaf(leaf);
+	struct cs1550_file_entry files[MAX_FILES_IN_DIR + 1];
+	size_t num = leaf->num_files;
+	size_t pos = 0;
+	while(pos < num && compare_names(leaf->files[pos].fname, leaf->files[pos].fext, entry->fname, entry->fext) < 0)
+	{
+		pos++;
+	}
+	memcpy(files, leaf->files, pos * sizeof(struct cs1550_file_entry));
+	files[pos] = *entry;
+	memcpy(files + pos + 1, leaf->files + pos, (num - pos) * sizeof(struct cs1550_file_entry));
+	num++;
+
+	size_t n_leaf = path->blocks[path->depth];
+	if(num <= MAX_FILES_IN_DIR)
+	{
+		memcpy(leaf->files, files, num * sizeof(struct cs1550_file_entry));
+		leaf->num_files = num;
+		write_block(n_leaf, leaf);
+		return 0;
+	}
+
+	//Split the directory block in half. The right half goes to disk before anything points to it, and the left
+	//half is cut down last, so if we stop in between the moved files are in both halves rather than neither.
+	//fsck drops the copies left behind, since lookups never go to them
+	size_t num_left = num / 2;
+	struct cs1550_directory_entry right;
+	memset(&right, 0, sizeof(struct cs1550_directory_entry));
+	right.num_files = num - num_left;
+	memcpy(right.files, files + num_left, right.num_files * sizeof(struct cs1550_file_entry));
+	size_t n_right = alloc_blocks_near(1, n_leaf);
+	write_block(n_right, &right);
+
+	struct cs1550_dir_key key;
+	memcpy(key.fname, right.files[0].fname, sizeof(key.fname));
+	memcpy(key.fext, right.files[0].fext, sizeof(key.fext));
+	if(dir_insert_child(path, path->depth, &key, n_right) != 0)
+	{
+		free_block(n_right);
+		return -ENOSPC;
+	}
+
+	memset(leaf, 0, sizeof(struct cs1550_directory_entry));
+	leaf->num_files = num_left;
+	memcpy(leaf->files, files, num_left * sizeof(struct cs1550_file_entry));
+	write_block(n_leaf, leaf);
+	return 0;
+}
+
+/**
+	Add n_child to the node above path->blocks[level], right after path->blocks[level], which it was split from.
+	`key` is the first name in n_child. If path->blocks[level] is the top of the tree, a new node goes on top of
+	the two. A full node is split the same way, its middle key going up to the node above. The caller makes sure
+	there's space for the new nodes, but pointing the directory to a new top node can also take copies of the
+	blocks above it(See set_start_block). Returns 0, or -ENOSPC with nothing that was already there changed
+**/
+static int dir_insert_child(struct dir_path *path, size_t level, const struct cs1550_dir_key *key, size_t n_child)
+{
+	union dir_block block;
+	memset(&block, 0, sizeof(union dir_block));
+
+	//The tree grows a level, and the directory's entry leads to the new node
+	if(level == 0)
+	{
+		block.node.num_keys = 1 | DIR_NODE_INTERIOR;
+		block.node.keys[0] = *key;
+		block.node.children[0] = path->blocks[0];
+		block.node.children[1] = n_child;
+		size_t n_top = alloc_blocks_near(1, path->blocks[0]);
+		write_block(n_top, &block);
+		if(set_start_block(path->dir, path->dir_len, n_top) != 0)
+		{
+			free_block(n_top);
+			return -ENOSPC;
+		}
+		return 0;
+	}
+
+	size_t n_node = path->blocks[level - 1];
+	size_t slot = path->slots[level - 1];
+	read_dir_block(n_node, &block);
+	size_t num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+
+	//Lay out the keys and children with the new ones right after the child that was split
+	struct cs1550_dir_key keys[MAX_KEYS_IN_DIR_NODE + 1];
+	size_t children[MAX_KEYS_IN_DIR_NODE + 2];
+	memcpy(keys, block.node.keys, slot * sizeof(struct cs1550_dir_key));
+	keys[slot] = *key;
+	memcpy(keys + slot + 1, block.node.keys + slot, (num_keys - slot) * sizeof(struct cs1550_dir_key));
+	memcpy(children, block.node.children, (slot + 1) * sizeof(size_t));
+	children[slot + 1] = n_child;
+	memcpy(children + slot + 2, block.node.children + slot + 1, (num_keys - slot) * sizeof(size_t));
+	num_keys++;
+
+	if(num_keys <= MAX_KEYS_IN_DIR_NODE)
+	{
+		block.node.num_keys = num_keys | DIR_NODE_INTERIOR;
+		memcpy(block.node.keys, keys, num_keys * sizeof(struct cs1550_dir_key));
+		memcpy(block.node.children, children, (num_keys + 1) * sizeof(size_t));
+		write_block(n_node, &block);
+		return 0;
+	}
+
+	//Split the node, written in the same order as a directory block(See dir_insert). The key in the middle
+	//separates the halves, so it moves up instead of staying in either
+	size_t num_left = num_keys / 2;
+	size_t num_right = num_keys - num_left - 1;
+	union dir_block right;
+	memset(&right, 0, sizeof(union dir_block));
+	right.node.num_keys = num_right | DIR_NODE_INTERIOR;
+	memcpy(right.node.keys, keys + num_left + 1, num_right * sizeof(struct cs1550_dir_key));
+	memcpy(right.node.children, children + num_left + 1, (num_right + 1) * sizeof(size_t));
+	size_t n_right = alloc_blocks_near(1, path->blocks[level]);
+	write_block(n_right, &right);
+
+	if(dir_insert_child(path, level - 1, &keys[num_left], n_right) != 0)
+	{
+		free_block(n_right);
+		return -ENOSPC;
+	}
+
+	memset(&block, 0, sizeof(union dir_block));
+	block.node.num_keys = num_left | DIR_NODE_INTERIOR;
+	memcpy(block.node.keys, keys, num_left * sizeof(struct cs1550_dir_key));
+	memcpy(block.node.children, children, (num_left + 1) * sizeof(size_t));
+	write_block(n_node, &block);
+	return 0;
+}
+
+/**
+	Remove file n_file from the directory block at the end of `path`, `leaf` being the caller's copy of it. A
+	directory block left empty is dropped from the node above it, along with any node that leaves without
+	children, unless it's all the directory has left. When the top node is down to one child, that child takes
+	its place. Returns 0, or -ENOSPC if the blocks on the path couldn't be copied(See cow_file)
+**/
+static int dir_remove(struct dir_path *path, struct cs1550_directory_entry *leaf, size_t n_file)
+{
+	if(cow_file(path, leaf, NULL) != 0)
+	{
+		return -ENOSPC;
+	}
+
+	leaf->num_files--;
+	memmove(&leaf->files[n_file], &leaf->files[n_file + 1], (leaf->num_files - n_file) * sizeof(struct cs1550_file_entry));
+	memset(&leaf->files[leaf->num_files], 0, sizeof(struct cs1550_file_entry));
+	if(leaf->num_files > 0 || path->depth == 0)
+	{
+		write_block(path->blocks[path->depth], leaf);
+		return 0;
+	}
+
+	//Find the lowest node that has another child besides the one we came from
+	union dir_block block;
+	size_t level = path->depth;
+	size_t num_keys = 0;
+	while(level > 0 && num_keys == 0)
+	{
+		level--;
+		read_dir_block(path->blocks[level], &block);
+		num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+	}
+
+	//Blocks that are no longer part of the tree, freed once nothing points to them
+	size_t dead[DIR_MAX_DEPTH + 1];
+	size_t num_dead = 0;
+	if(num_keys == 0)
+	{
+		//There is nothing else left in the directory, so the empty directory block becomes its only block. If
+		//the directory can't be pointed to it, the nodes above it stay and still lead to it
+		write_block(path->blocks[path->depth], leaf);
+		if(set_start_block(path->dir, path->dir_len, path->blocks[path->depth]) == 0)
+		{
+			for(size_t i = 0; i < path->depth; i++)
+			{
+				dead[num_dead++] = path->blocks[i];
+			}
+		}
+	}
+	else
+	{
+		for(size_t i = level + 1; i <= path->depth; i++)
+		{
+			dead[num_dead++] = path->blocks[i];
+		}
+
+		//Remove the child along with the key that separates it from its neighbour. The first child has no key
+		//of its own, so the second one takes over everything before it
+		size_t slot = path->slots[level];
+		size_t n_key = slot > 0 ? slot - 1 : 0;
+		memmove(&block.node.keys[n_key], &block.node.keys[n_key + 1], (num_keys - n_key - 1) * sizeof(struct cs1550_dir_key));
+		memmove(&block.node.children[slot], &block.node.children[slot + 1], (num_keys - slot) * sizeof(size_t));
+		num_keys--;
+		memset(&block.node.keys[num_keys], 0, sizeof(struct cs1550_dir_key));
+		block.node.children[num_keys + 1] = 0;
+		block.node.num_keys = num_keys | DIR_NODE_INTERIOR;
+
+		//A top node with one child left is replaced by it, or if that can't be done, kept with just the one
+		if(level == 0 && num_keys == 0 && set_start_block(path->dir, path->dir_len, block.node.children[0]) == 0)
+		{
+			dead[num_dead++] = path->blocks[0];
+		}
+		else
+		{
+			write_block(path->blocks[level], &block);
+		}
+	}
+
+	for(size_t i = 0; i < num_dead; i++)
+	{
+		free_block(dead[i]);
+	}
+	return 0;
+}
+
+/**
+	Return the first COOKIE_PREFIX_LEN characters of a file name as a number, which sorts the same way the
+	names do. readdir offsets are built from it
+**/
+static uint64_t name_prefix(const char *fname)
+{
+	uint64_t prefix = 0;
+	int ended = 0;
+	for(size_t i = 0; i < COOKIE_PREFIX_LEN; i++)
+	{
+		ended = ended || fname[i] == '\0';
+		prefix = (prefix << 8) | (ended ? 0 : (unsigned char)fname[i]);
+	}
+	return prefix;
+}
+
+/**
+	Loop through the path to ensure all arguments are the correct length. Every component needs a name of at
+	most MAX_FILENAME characters, followed by an extension of at most MAX_EXTENSION after its first ., except
+	directories in the root, which keep their whole name in MAX_FILENAME characters
+**/
+static int check_path(const char *path)
+{
+	char name[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	if(strcmp(path, "/") == 0)
+	{
+		return 1;
+	}
+
+	size_t depth = 0;
+	while(*path == '/')
+	{
+		path++;
+		size_t len = strcspn(path, "/");
+		if(len == 0 || ++depth > MAX_PATH_DEPTH)
+		{
+			return 0;
+		}
+		if(depth == 1 ? len > MAX_FILENAME : split_name(path, len, name, extension) != 0)
+		{
+			return 0;
+		}
+		path += len;
+	}
+	return *path == '\0';
+}
+
+/**
+	Parse a path checked by check_path, the way sscanf(path, "/%[^/]/%[^.].%s", ...) would if directories were
+	only ever in the root. Returns 0 for the root itself, 1 for a directory in the root, whose whole name goes in
+	`name`, and for anything deeper 2, or 3 if its last component has an extension. dir_len is set to the length
+	of the path of the directory the last component is in
+**/
+static int parse_path(const char *path, size_t *dir_len, char name[], char extension[])
+{
+	const char *last = strrchr(path, '/');
+	*dir_len = last - path;
+	if(last[1] == '\0')
+	{
+		return 0;
+	}
+	if(*dir_len == 0)
+	{
+		snprintf(name, MAX_FILENAME + 1, "%s", last + 1);
+		return 1;
+	}
+	split_name(last + 1, strlen(last + 1), name, extension);
+	return extension[0] != '\0' ? 3 : 2;
+}
+
+/**
+	Split the len characters of a path component at `component` into a name and an extension at its first . Returns
+	0, or -1 if either is too long to fit in a directory entry
+**/
+static int split_name(const char *component, size_t len, char name[], char extension[])
+{
+	size_t name_len = 0;
+	while(name_len < len && component[name_len] != '.')
+	{
+		name_len++;
+	}
+	size_t ext_len = name_len < len ? len - name_len - 1 : 0;
+	if(name_len > MAX_FILENAME || ext_len > MAX_EXTENSION)
+	{
+		return -1;
+	}
+	memcpy(name, component, name_len);
+	name[name_len] = '\0';
+	if(ext_len > 0)
+	{
+		memcpy(extension, component + name_len + 1, ext_len);
+	}
+	extension[ext_len] = '\0';
+	return 0;
+}
+
+/**
+	Return a BLOCK_SIZE buffer for a block, or null if there's no memory left. The handlers need one for nearly
+	every call, so buffers handed back with block_buf_free are kept by the thread and reused, and a thread that
+	keeps doing the same thing stops going to malloc at all. Each buffer is its own allocation, so one freed by
+	another thread, or with free, is fine too
+**/
+static void *block_buf_alloc(void)
+{
+	struct block_buf *buf = block_bufs;
+	if(!buf)
+	{
+		return malloc(BLOCK_SIZE);
+	}
+	block_bufs = buf->next;
+	num_block_bufs--;
+	return buf;
+}
+
+/**
+	Hand back a buffer from block_buf_alloc, or null, for the calling thread to reuse
+**/
+static void block_buf_free(void *buf)
+{
+	if(!buf)
+	{
+		return;
+	}
+	if(num_block_bufs >= BLOCK_BUF_POOL_MAX)
+	{
+		free(buf);
+		return;
+	}
+	//The first buffer a thread keeps makes sure they're all freed when it exits
+	if(!block_bufs)
+	{
+		pthread_once(&block_buf_once, block_buf_make_key);
+		pthread_setspecific(block_buf_key, &block_bufs);
+	}
+	struct block_buf *free_buf = buf;
+	free_buf->next = block_bufs;
+	block_bufs = free_buf;
+	num_block_bufs++;
+}
+
+/**
+	Free every buffer on a thread's list, given as a pointer to the head of the list. Called when a thread exits,
+	and on unmount for the thread doing it
+**/
+static void block_buf_drain(void *list)
+{
+	struct block_buf **head = list;
+	while(*head)
+	{
+		struct block_buf *next = (*head)->next;
+		free(*head);
+		*head = next;
+	}
+	if(head == &block_bufs)
+	{
+		num_block_bufs = 0;
+	}
+}
+
+/**
+	Create the key whose destructor frees a thread's buffers, once per process
+**/
+static void block_buf_make_key(void)
+{
+	pthread_key_create(&block_buf_key, block_buf_drain);
+}
+
+/**
+	Read block number n_block of the .disk file into buf. Returns 0, or -EIO if the block doesn't match its checksum
+**/
+static int read_block(size_t n_block, void *buf)
+{
+	//In O_DIRECT mode, copy the block out of its cached page
+	if(options.odirect)
+	{
+		memcpy(buf, page_cache_get(n_block / BLOCKS_PER_PAGE) + (n_block % BLOCKS_PER_PAGE) * BLOCK_SIZE, BLOCK_SIZE);
+		return checksum_verify(n_block, buf);
+	}
+
+	off_t offset;
+	size_t n_image = map_block(n_block, &offset);
+	//With -o shared, copy the block straight out of the image's mapping. Anything past its end reads as zeros
+	if(image_maps[n_image])
+	{
+		if((size_t)offset + BLOCK_SIZE <= image_map_sizes[n_image])
+		{
+			memcpy(buf, image_maps[n_image] + offset, BLOCK_SIZE);
+		}
+		else
+		{
+			memset(buf, 0, BLOCK_SIZE);
+		}
+		return checksum_verify(n_block, buf);
+	}
+
+	int fd = image_fds[n_image];
+	ssize_t res = pread(fd, buf, BLOCK_SIZE, offset);
+	//Anything past the end of the disk reads as zeros
+	if(res < BLOCK_SIZE)
+	{
+		memset((char*)buf + (res > 0 ? res : 0), 0, BLOCK_SIZE - (res > 0 ? res : 0));
+	}
+	return checksum_verify(n_block, buf);
+}
+
+/**
+	Write buf to block number n_block of the .disk file. Every write to the disk goes through here,
+	so this is also where the directory block cache is kept up to date
+**/
+static void write_block(size_t n_block, const void *buf)
+{
+	if(options.odirect)
+	{
+		//In O_DIRECT mode, update the block in its cached page and write the whole page through
+		size_t n_page = n_block / BLOCKS_PER_PAGE;
+		unsigned char *page = page_cache_get(n_page);
+		memcpy(page + (n_block % BLOCKS_PER_PAGE) * BLOCK_SIZE, buf, BLOCK_SIZE);
+		off_t offset;
+		int fd = image_fds[map_block(n_page * BLOCKS_PER_PAGE, &offset)];
+		pwrite(fd, page, IO_ALIGN, offset);
+	}
+	else
+	{
+		off_t offset;
+		int fd = image_fds[map_block(n_block, &offset)];
+		pwrite(fd, buf, BLOCK_SIZE, offset);
+	}
+
+	checksum_store(n_block, buf);
+
+	//If this block is cached, refresh the cached copy so it never goes stale
+	struct dir_cache_slot *slot = &dir_cache[n_block % DIR_CACHE_SLOTS];
+	if(slot->valid && slot->n_block == n_block)
+	{
+		memcpy(&slot->dir, buf, BLOCK_SIZE);
+	}
+}
+
+/**
+	Read a block of a directory, either a directory block or a node above them, into buf, serving it from the
+	directory block cache when possible
+**/
+static void read_dir_block(size_t n_block, void *buf)
+{
+	//With -o shared the block is already in memory, in the image's mapping, and nothing is cached that several
+	//threads would write to(See lookup_child)
+	if(options.shared)
+	{
+		read_block(n_block, buf);
+		return;
+	}
+	struct dir_cache_slot *slot = &dir_cache[n_block % DIR_CACHE_SLOTS];
+	//On a miss, read the block from disk and replace whatever was in the slot
+	if(!slot->valid || slot->n_block != n_block)
+	{
+		read_block(n_block, &slot->dir);
+		slot->n_block = n_block;
+		slot->valid = 1;
+	}
+	memcpy(buf, &slot->dir, BLOCK_SIZE);
+}
+
+/**
+	Fill in the attributes of a subdirectory(Or the root)
+**/
+static void fill_dir_stat(struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(struct stat));
+	statbuf->st_mode = S_IFDIR | 0755;
+	statbuf->st_nlink = 2;
+}
+
+/**
+	Fill in the attributes of a regular file from its entry in a directory block
+**/
+static void fill_file_stat(struct stat *statbuf, struct cs1550_file_entry *file)
+{
+	memset(statbuf, 0, sizeof(struct stat));
+	statbuf->st_mode = S_IFREG | 0666;
+	// Only one hard link to this file
+	statbuf->st_nlink = 1;
+	statbuf->st_size = file->fsize;
+}
+
+/**
+	Parse a path to a file and return the block number of its index block, or 0 if there is no such file
+**/
+static size_t lookup_index_block(const char *path)
+{
+	size_t dir_len;
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1] = "";
+
+	if(check_path(path) == 0)
+	{
+		return 0;
+	}
+	int res = parse_path(path, &dir_len, filename, extension);
+	if(res != 2 && res != 3)
+	{
+		return 0;
+	}
+
+	struct dir_path where;
+	struct cs1550_directory_entry *dir = find_leaf(path, dir_len, filename, extension, &where);
+	if(!dir)
+	{
+		return 0;
+	}
+	struct cs1550_file_entry *file = find_file(dir, filename, extension);
+	size_t n_index_block = file && !(file->fsize & FILE_IS_DIRECTORY) ? file->n_index_block : 0;
+	block_buf_free(dir);
+	return n_index_block;
+}
+
+/**
+	Return the buffered data of the file with the given index block, or null if it has none
+**/
+static struct dirty_file * delalloc_find(size_t n_index_block)
+{
+	if(n_index_block == 0)
+	{
+		return NULL;
+	}
+	for(size_t i = 0; i < DELALLOC_MAX_FILES; i++)
+	{
+		if(dirty_files[i].num_pending > 0 && dirty_files[i].n_index_block == n_index_block)
+		{
+			return &dirty_files[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+	Return the buffered copy of data block `entry` of a file, or null if that block isn't buffered
+**/
+static struct cs1550_data_block * delalloc_lookup(size_t n_index_block, size_t entry)
+{
+	struct dirty_file *dirty = delalloc_find(n_index_block);
+	return dirty ? dirty->pending[entry] : NULL;
+}
+
+/**
+	Return a buffer for data block `entry` of a file that has no block on disk yet, creating a zeroed one
+	if needed. A block is reserved for every buffer, so this returns null once the disk would be full
+**/
+static struct cs1550_data_block * delalloc_buffer(size_t n_index_block, size_t entry)
+{
+	struct dirty_file *dirty = delalloc_find(n_index_block);
+	if(dirty && dirty->pending[entry])
+	{
+		return dirty->pending[entry];
+	}
+
+	//Make sure the block can be placed once the file is flushed
+	if(blocks_available() < 1)
+	{
+		return NULL;
+	}
+
+	if(!dirty)
+	{
+		//Find a free slot for the file, placing everything that is buffered if there isn't one
+		for(size_t i = 0; i < DELALLOC_MAX_FILES && !dirty; i++)
+		{
+			if(dirty_files[i].num_pending == 0)
+			{
+				dirty = &dirty_files[i];
+			}
+		}
+		if(!dirty)
+		{
+			delalloc_flush_all();
+			dirty = &dirty_files[0];
+		}
+		dirty->n_index_block = n_index_block;
+	}
+
+	struct cs1550_data_block *data = delalloc_buf_alloc();
+	if(!data)
+	{
+		return NULL;
+	}
+	memset(data, 0, sizeof(struct cs1550_data_block));
+	dirty->pending[entry] = data;
+	dirty->num_pending++;
+	delalloc_pending++;
+	return data;
+}
+
+/**
+	Give every buffered block of a file a block on disk and write it out. The blocks are allocated as one
+	contiguous run in file order, so the file can be read back sequentially
+**/
+static int delalloc_flush(struct dirty_file *dirty)
+{
+	if(!dirty || dirty->num_pending == 0)
+	{
+		return 0;
+	}
+
+	struct cs1550_index_block *index = block_buf_alloc();
+	if(!index)
+	{
+		return -ENOMEM;
+	}
+	//Without the index block there's nowhere to record where the data goes. Drop it rather than keep it buffered
+	//and fail the same way on every flush
+	if(read_block(dirty->n_index_block, index) != 0)
+	{
+		for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+		{
+			delalloc_drop(dirty->n_index_block, i);
+		}
+		block_buf_free(index);
+		return -EIO;
+	}
+
+	//Place the blocks one after another in a single free run, following the file's blocks before them. If free
+	//space is too fragmented for that, fall back to placing them one at a time. Either way, they were reserved
+	//when they were buffered
+	size_t first = 0;
+	while(!dirty->pending[first])
+	{
+		first++;
+	}
+	size_t n_goal = data_goal(index, dirty->n_index_block, first);
+	size_t n_block = alloc_blocks_near(dirty->num_pending, n_goal);
+	for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+	{
+		if(dirty->pending[i])
+		{
+			index->entries[i] = n_block ? n_block++ : alloc_blocks_near(1, n_goal);
+			write_block(index->entries[i], dirty->pending[i]);
+			delalloc_buf_free(dirty->pending[i]);
+			dirty->pending[i] = NULL;
+		}
+	}
+	delalloc_pending -= dirty->num_pending;
+	dirty->num_pending = 0;
+
+	//Write changes to the index block and root back to disk
+	write_block(dirty->n_index_block, index);
+	write_block(0, root);
+	block_buf_free(index);
+	return 0;
+}
+
+/**
+	Place the buffered data of every file on disk
+**/
+static void delalloc_flush_all(void)
+{
+	for(size_t i = 0; i < DELALLOC_MAX_FILES; i++)
+	{
+		delalloc_flush(&dirty_files[i]);
+	}
+}
+
+/**
+	Drop the buffered copy of data block `entry` of a file, if there is one
+**/
+static void delalloc_drop(size_t n_index_block, size_t entry)
+{
+	struct dirty_file *dirty = delalloc_find(n_index_block);
+	if(dirty && dirty->pending[entry])
+	{
+		delalloc_buf_free(dirty->pending[entry]);
+		dirty->pending[entry] = NULL;
+		dirty->num_pending--;
+		delalloc_pending--;
+	}
+}
+
+/**
+	Return a BLOCK_SIZE buffer for buffered data, or null if there's no memory left. They come from the buffers set
+	aside on mount, which are shared by every thread, so the first files written don't go to malloc for them. If
+	those run out, it falls back to block_buf_alloc
+**/
+static void *delalloc_buf_alloc(void)
+{
+	struct block_buf *buf = delalloc_bufs;
+	if(!buf)
+	{
+		return block_buf_alloc();
+	}
+	delalloc_bufs = buf->next;
+	num_delalloc_bufs--;
+	return buf;
+}
+
+/**
+	Hand back a buffer from delalloc_buf_alloc. Buffers beyond the ones set aside go to the calling thread's pool
+**/
+static void delalloc_buf_free(void *buf)
+{
+	if(num_delalloc_bufs >= DELALLOC_BUFS)
+	{
+		block_buf_free(buf);
+		return;
+	}
+	struct block_buf *free_buf = buf;
+	free_buf->next = delalloc_bufs;
+	delalloc_bufs = free_buf;
+	num_delalloc_bufs++;
+}
+
+/**
+	Free every block of the file with the given index block, buffered data included, for when its entry is
+	about to go away. Blocks a snapshot still uses stay where they are
+**/
+static void free_file(size_t n_index_block)
+{
+	struct cs1550_index_block index;
+	for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+	{
+		delalloc_drop(n_index_block, i);
+	}
+
+	//If the index block can't be read, its data blocks are left for fsck to find
+	if(read_block(n_index_block, &index) == 0)
+	{
+		for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+		{
+			free_block(index.entries[i]);
+		}
+	}
+	free_block(n_index_block);
+	num_files--;
+}
+
+/**
+	Walk the directory tree and mark every block that is in use: the root, the directory blocks, and every file's
+	index and data blocks, and the same for every snapshot. Everything else is free
+**/
+static void build_block_bitmap(void)
+{
+	//Size the bitmaps for the largest the disk can grow to, so they never have to be resized
+	free(block_bitmap);
+	free(frozen_bitmap);
+	free(group_free);
+	free(log_segments);
+	block_bitmap = calloc((max_blocks + 7) / 8, 1);
+	frozen_bitmap = calloc((max_blocks + 7) / 8, 1);
+	group_free = calloc((max_blocks + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS, sizeof(size_t));
+	log_clean_segments = (max_blocks + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+	log_segments = calloc(log_clean_segments, sizeof(struct log_segment));
+	free_blocks = total_blocks;
+	for(size_t n_block = 0; n_block < total_blocks; n_block++)
+	{
+		group_free[n_block / ALLOC_GROUP_BLOCKS]++;
+	}
+	num_files = 0;
+	num_dirs = 0;
+
+	//The root is always block 0
+	mark_block_used(0);
+	mark_tree(root, 0);
+
+	//Every snapshot's copy of the root, and everything it points to, is frozen
+	struct cs1550_root_directory *snapshot = malloc(sizeof(struct cs1550_root_directory));
+	for(size_t i = 0; i < root->num_directories; i++)
+	{
+		if(is_snapshot(root->directories[i].dname))
+		{
+			mark_block_used(root->directories[i].n_start_block);
+			mark_block_frozen(root->directories[i].n_start_block);
+			read_block(root->directories[i].n_start_block, snapshot);
+			mark_tree(snapshot, 1);
+		}
+	}
+	free(snapshot);
+
+	//Keep handing out blocks from where the last mount left off
+	alloc_cursor = root->last_allocated_block + 1;
+}
+
+/**
+	Check if a block is marked as in use in the bitmap
+**/
+static int block_in_use(size_t n_block)
+{
+	return (block_bitmap[n_block / 8] >> (n_block % 8)) & 1;
+}
+
+/**
+	Mark a block as in use in the bitmap
+**/
+static void mark_block_used(size_t n_block)
+{
+	//Ignore blocks past the end of the disk or ones that are already marked
+	if(n_block >= total_blocks || block_in_use(n_block))
+	{
+		return;
+	}
+	block_bitmap[n_block / 8] |= 1 << (n_block % 8);
+	free_blocks--;
+	group_free[n_block / ALLOC_GROUP_BLOCKS]--;
+	if(log_segments[n_block / LOG_SEGMENT_BLOCKS].used++ == 0)
+	{
+		log_clean_segments--;
+	}
+
+	//Keep the root's record of the last allocated block up to date
+	if(n_block > root->last_allocated_block)
+	{
+		root->last_allocated_block = n_block;
+	}
+}
+
+/**
+	Return the number of blocks that are free or that the disk can still grow by, minus the ones promised
+	to buffered writes
+**/
+static size_t blocks_available(void)
+{
+	return free_blocks + (max_blocks - total_blocks) - delalloc_pending;
+}
+
+/**
+	Allocate `count` contiguous free blocks with no particular place in mind(See alloc_blocks_near)
+**/
+static size_t alloc_blocks(size_t count)
+{
+	return alloc_blocks_near(count, 0);
+}
+
+/**
+	Allocate `count` contiguous free blocks and return the first one, or 0 if there is no free run that long.
+	The search starts at n_goal and goes towards the end of the disk, so blocks end up as close after the goal
+	as there's room for. With no goal(0), it picks up where the last such search stopped, so those blocks are
+	handed out in increasing order until the end of the disk is reached. If no run is long enough the disk grows,
+	up to its maximum size. In log mode, blocks are taken from the head of the log first(See log_alloc)
+**/
+static size_t alloc_blocks_near(size_t count, size_t n_goal)
+{
+	if(count == 0 || count > free_blocks + (max_blocks - total_blocks))
+	{
+		return 0;
+	}
+
+	//In log mode, blocks come from the head of the log for as long as there are clean segments
+	if(options.log)
+	{
+		size_t n_block = log_alloc(count);
+		if(n_block != 0)
+		{
+			return n_block;
+		}
+	}
+
+	size_t n_block = n_goal != 0 ? n_goal : alloc_cursor;
+	size_t run = 0;
+	//Looking at every block once, plus enough to finish a run that started before the cursor, covers the whole disk
+	for(size_t scanned = 0; scanned < total_blocks + count; scanned++, n_block++)
+	{
+		//Wrap around to the start of the disk. A run can't continue across the end
+		if(n_block >= total_blocks)
+		{
+			n_block = 1;
+			run = 0;
+			if(n_block >= total_blocks)
+			{
+				break;
+			}
+		}
+
+		if(block_in_use(n_block))
+		{
+			run = 0;
+		}
+		else if(++run == count)
+		{
+			size_t start = n_block - count + 1;
+			for(size_t i = start; i <= n_block; i++)
+			{
+				mark_block_used(i);
+			}
+			if(n_goal == 0)
+			{
+				alloc_cursor = n_block + 1;
+			}
+			return start;
+		}
+	}
+
+	//Nothing long enough, make room at the end of the disk and look again
+	if(grow_disk(count))
+	{
+		return alloc_blocks_near(count, n_goal);
+	}
+	return 0;
+}
+
+/**
+	Pick where a new directory in the root goes, the way FFS spreads directories across cylinder groups: at the
+	start of the allocation group with the most free blocks, so its files have room to be placed around it. Once
+	every group is at least half full, the disk grows if it can and the directory starts one of the new groups.
+	Returns the block to start looking from, or 0 in log mode, where blocks are placed in the order they're
+	written instead
+**/
+static size_t dir_group_goal(void)
+{
+	if(options.log)
+	{
+		return 0;
+	}
+
+	size_t best = 0;
+	for(int grown = 0; ; grown = 1)
+	{
+		best = 0;
+		for(size_t g = 1; g * ALLOC_GROUP_BLOCKS < total_blocks; g++)
+		{
+			if(group_free[g] > group_free[best])
+			{
+				best = g;
+			}
+		}
+		if(grown || group_free[best] >= ALLOC_GROUP_BLOCKS / 2 || !grow_disk(ALLOC_GROUP_BLOCKS))
+		{
+			break;
+		}
+	}
+	//Block 0 is always the root
+	return best == 0 ? 1 : best * ALLOC_GROUP_BLOCKS;
+}
+
+/**
+	Return where to look for a block for entry `entry` of a file: right after the closest block of the file
+	before it, so the file is laid out in order, or after its index block if there's none
+**/
+static size_t data_goal(const struct cs1550_index_block *index, size_t n_index_block, size_t entry)
+{
+	for(size_t i = entry; i > 0; i--)
+	{
+		if(index->entries[i - 1] != 0)
+		{
+			return index->entries[i - 1] + 1;
+		}
+	}
+	return n_index_block + 1;
+}
+
+/**
+	Give a block back to the allocator. Free blocks always read as zeros, so the block is trimmed from the .disk
+	file too, which also hands its space back to the host
+**/
+static void free_block(size_t n_block)
+{
+	//The root can never be freed, and a block that belongs to a snapshot stays in use until the snapshot is removed
+	if(n_block == 0 || n_block >= total_blocks || !block_in_use(n_block) || block_frozen(n_block))
+	{
+		return;
+	}
+	block_bitmap[n_block / 8] &= ~(1 << (n_block % 8));
+	free_blocks++;
+	group_free[n_block / ALLOC_GROUP_BLOCKS]++;
+
+	//A segment that empties is clean again, even one the cleaner gave up on
+	struct log_segment *segment = &log_segments[n_block / LOG_SEGMENT_BLOCKS];
+	if(--segment->used == 0)
+	{
+		log_clean_segments++;
+		segment->stuck = 0;
+	}
+	trim_blocks(n_block, 1);
+}
+
+/**
+	Zero `count` blocks starting at n_block. The .disk file's filesystem is asked to do it without writing
+	any data if it can
+**/
+static void zero_blocks(size_t n_block, size_t count)
+{
+	if(fallocate_blocks(FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, n_block, count) == 0)
+	{
+		drop_cached_blocks(n_block, count);
+		return;
+	}
+
+	//Not supported by the host filesystem, write the zeros ourselves
+	struct cs1550_data_block zero;
+	memset(&zero, 0, sizeof(struct cs1550_data_block));
+	for(size_t i = 0; i < count; i++)
+	{
+		write_block(n_block + i, &zero);
+	}
+}
+
+/**
+	Punch `count` blocks starting at n_block out of the .disk file. They read as zeros afterwards and no longer
+	take up space on the host. Falls back to zeroing them if the host filesystem can't punch holes
+**/
+static void trim_blocks(size_t n_block, size_t count)
+{
+	if(fallocate_blocks(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, n_block, count) != 0)
+	{
+		zero_blocks(n_block, count);
+		return;
+	}
+	drop_cached_blocks(n_block, count);
+}
+
+/**
+	Trim every run of free blocks. Run at mount, so blocks that were leaked or written by older versions
+	don't keep taking up space and read as zeros once they're reused
+**/
+static void trim_free_space(void)
+{
+	size_t start = 0;
+	for(size_t n_block = 1; n_block <= total_blocks; n_block++)
+	{
+		int in_use = n_block == total_blocks || block_in_use(n_block);
+		if(!in_use && start == 0)
+		{
+			start = n_block;
+		}
+		else if(in_use && start != 0)
+		{
+			trim_blocks(start, n_block - start);
+			start = 0;
+		}
+	}
+}
+
+/**
+	Grow the .disk file so at least `count` more blocks fit, up to the maximum size. It grows by
+	DISK_GROW_BLOCKS at a time, and the new blocks are holes, so they cost nothing on the host until written.
+	Returns 1 if the disk grew
+**/
+static int grow_disk(size_t count)
+{
+	if(total_blocks + count > max_blocks)
+	{
+		return 0;
+	}
+
+	size_t new_total = total_blocks + (count > DISK_GROW_BLOCKS ? count : DISK_GROW_BLOCKS);
+	new_total = (new_total + disk_granularity - 1) / disk_granularity * disk_granularity;
+	if(new_total > max_blocks)
+	{
+		new_total = max_blocks;
+	}
+	if(resize_disk(new_total) != 0)
+	{
+		return 0;
+	}
+	for(size_t n_block = total_blocks; n_block < new_total; n_block++)
+	{
+		group_free[n_block / ALLOC_GROUP_BLOCKS]++;
+	}
+	free_blocks += new_total - total_blocks;
+	total_blocks = new_total;
+	return 1;
+}
+
+/**
+	Forget cached copies of `count` blocks starting at n_block after they were zeroed behind the caches' back,
+	along with their checksums
+**/
+static void drop_cached_blocks(size_t n_block, size_t count)
+{
+	checksum_forget(n_block, count);
+
+	for(size_t i = n_block; i < n_block + count; i++)
+	{
+		struct dir_cache_slot *slot = &dir_cache[i % DIR_CACHE_SLOTS];
+		if(slot->valid && slot->n_block == i)
+		{
+			slot->valid = 0;
+		}
+
+		//Only part of a page was zeroed, so zero that part of the cached copy rather than dropping it
+		struct page_cache_slot *page = &page_cache[(i / BLOCKS_PER_PAGE) % PAGE_CACHE_SLOTS];
+		if(page->valid && page->n_page == i / BLOCKS_PER_PAGE)
+		{
+			memset(page->data + (i % BLOCKS_PER_PAGE) * BLOCK_SIZE, 0, BLOCK_SIZE);
+		}
+	}
+}
+
+/**
+	Return the cached copy of page n_page of the .disk file, reading it in if it isn't cached. Only used in
+	O_DIRECT mode, where every read and write has to cover a whole aligned page
+**/
+static unsigned char * page_cache_get(size_t n_page)
+{
+	struct page_cache_slot *slot = &page_cache[n_page % PAGE_CACHE_SLOTS];
+	if(!slot->valid || slot->n_page != n_page)
+	{
+		//Stripe units are whole pages in O_DIRECT mode, so a page always lives on a single image
+		off_t offset;
+		int fd = image_fds[map_block(n_page * BLOCKS_PER_PAGE, &offset)];
+		ssize_t res = pread(fd, slot->data, IO_ALIGN, offset);
+		//Anything past the end of the disk reads as zeros
+		if(res < IO_ALIGN)
+		{
+			memset(slot->data + (res > 0 ? res : 0), 0, IO_ALIGN - (res > 0 ? res : 0));
+		}
+		slot->n_page = n_page;
+		slot->valid = 1;
+	}
+	return slot->data;
+}
+
+/**
+	Parse a size in bytes with an optional K, M or G suffix, e.g. "512K" or "2G"
+**/
+static size_t parse_size(const char *str)
+{
+	char *suffix;
+	size_t size = strtoull(str, &suffix, 10);
+	switch(*suffix)
+	{
+		case 'G': case 'g':
+			size *= 1024;
+			//Fall through
+		case 'M': case 'm':
+			size *= 1024;
+			//Fall through
+		case 'K': case 'k':
+			size *= 1024;
+			break;
+	}
+	return size;
+}
+
+/**
+	Open the image files backing the disk and work out how many blocks it has. That's just .disk, or every image
+	listed with -o stripe. Returns 0 on success
+**/
+static int open_disk(void)
+{
+	//Split the list of images up. Our copy of it is only needed until they're all open
+	char *paths[MAX_IMAGES];
+	char *list = strdup(options.stripe ? options.stripe : ".disk");
+	char *save = NULL;
+	num_images = 0;
+	for(char *path = strtok_r(list, ":", &save); path && num_images < MAX_IMAGES; path = strtok_r(NULL, ":", &save))
+	{
+		paths[num_images++] = path;
+	}
+
+	//Mapping the image shares it through the host's page cache, which O_DIRECT is there to avoid
+	if(options.shared && options.odirect)
+	{
+		fprintf(stderr, "cs1550: -o shared reads through the host's page cache, ignoring -o odirect\n");
+		options.odirect = 0;
+	}
+
+	//In O_DIRECT mode a stripe unit has to be made of whole pages
+	stripe_unit = options.stripe_unit ? options.stripe_unit : DEFAULT_STRIPE_UNIT;
+	if(options.odirect)
+	{
+		stripe_unit = (stripe_unit + BLOCKS_PER_PAGE - 1) / BLOCKS_PER_PAGE * BLOCKS_PER_PAGE;
+	}
+
+	if(options.odirect)
+	{
+		//Bypass the host's page cache. Not every filesystem supports that(e.g. tmpfs), so fall back to normal I/O
+		size_t opened = 0;
+		while(opened < num_images && (image_fds[opened] = open(paths[opened], (read_only ? O_RDONLY : O_RDWR) | O_DIRECT)) >= 0)
+		{
+			opened++;
+		}
+		if(opened < num_images || posix_memalign((void **)&page_cache_mem, IO_ALIGN, PAGE_CACHE_SLOTS * IO_ALIGN) != 0)
+		{
+			fprintf(stderr, "cs1550: can't open the disk with O_DIRECT, using buffered I/O\n");
+			while(opened > 0)
+			{
+				close(image_fds[--opened]);
+			}
+			page_cache_mem = NULL;
+			options.odirect = 0;
+		}
+		else
+		{
+			for(size_t i = 0; i < PAGE_CACHE_SLOTS; i++)
+			{
+				page_cache[i].data = page_cache_mem + i * IO_ALIGN;
+			}
+		}
+	}
+	if(!options.odirect)
+	{
+		for(size_t i = 0; i < num_images; i++)
+		{
+			image_fds[i] = open(paths[i], read_only ? O_RDONLY : O_RDWR);
+			if(image_fds[i] < 0)
+			{
+				fprintf(stderr, "cs1550: can't open %s: %s\n", paths[i], strerror(errno));
+				num_images = i;
+				close_disk();
+				free(list);
+				return -1;
+			}
+		}
+	}
+	free(list);
+
+	//Whole pages are written in O_DIRECT mode, and a striped disk always grows by a whole stripe across every image
+	if(num_images == 1)
+	{
+		disk_granularity = options.odirect ? BLOCKS_PER_PAGE : 1;
+	}
+	else
+	{
+		disk_granularity = num_images * stripe_unit;
+	}
+
+	//The disk is as big as its smallest image allows
+	size_t image_blocks = SIZE_MAX;
+	for(size_t i = 0; i < num_images; i++)
+	{
+		size_t blocks = lseek(image_fds[i], 0, SEEK_END) / BLOCK_SIZE;
+		if(blocks < image_blocks)
+		{
+			image_blocks = blocks;
+		}
+	}
+	if(num_images == 1)
+	{
+		total_blocks = image_blocks;
+	}
+	else
+	{
+		total_blocks = (image_blocks - image_blocks % stripe_unit) * num_images;
+	}
+
+	//The image only has to hold the root to begin with, everything else is added as it's needed
+	size_t rounded = total_blocks > 0 ? total_blocks : 1;
+	rounded = (rounded + disk_granularity - 1) / disk_granularity * disk_granularity;
+	if(rounded != total_blocks && !read_only && resize_disk(rounded) == 0)
+	{
+		total_blocks = rounded;
+	}
+
+	//With -o shared, map every image read-only. Every daemon serving the same image reads the same pages of the
+	//host's page cache, and nothing is written back. If an image can't be mapped, it's read with pread instead
+	if(options.shared)
+	{
+		for(size_t i = 0; i < num_images; i++)
+		{
+			off_t size = lseek(image_fds[i], 0, SEEK_END);
+			void *map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, image_fds[i], 0) : MAP_FAILED;
+			if(map == MAP_FAILED)
+			{
+				break;
+			}
+			image_maps[i] = map;
+			image_map_sizes[i] = size;
+		}
+		//Either every image is mapped or none are, so read_blocks can tell from the first
+		if(!image_maps[num_images - 1])
+		{
+			fprintf(stderr, "cs1550: can't map the disk, reading it with pread\n");
+			unmap_disk();
+		}
+	}
+
+	start_image_readers();
+	return 0;
+}
+
+/**
+	Close every image file backing the disk
+**/
+static void close_disk(void)
+{
+	stop_image_readers();
+	unmap_disk();
+	for(size_t i = 0; i < num_images; i++)
+	{
+		close(image_fds[i]);
+	}
+	num_images = 0;
+}
+
+/**
+	Unmap every image mapped with -o shared
+**/
+static void unmap_disk(void)
+{
+	for(size_t i = 0; i < num_images; i++)
+	{
+		if(image_maps[i])
+		{
+			munmap(image_maps[i], image_map_sizes[i]);
+			image_maps[i] = NULL;
+			image_map_sizes[i] = 0;
+		}
+	}
+}
+
+/**
+	Find where block n_block lives. Returns the index of its image and sets `offset` to its byte offset in that
+	image. Blocks are striped round robin across the images, `stripe_unit` consecutive blocks at a time
+**/
+static size_t map_block(size_t n_block, off_t *offset)
+{
+	if(num_images == 1)
+	{
+		*offset = (off_t)n_block * BLOCK_SIZE;
+		return 0;
+	}
+
+	size_t unit = n_block / stripe_unit;
+	*offset = (off_t)((unit / num_images) * stripe_unit + n_block % stripe_unit) * BLOCK_SIZE;
+	return unit % num_images;
+}
+
+/**
+	Resize the disk to n_blocks blocks, which must be a multiple of its granularity. Every image gets its share.
+	Returns 0 on success
+**/
+static int resize_disk(size_t n_blocks)
+{
+	off_t image_size = (off_t)(n_blocks / num_images) * BLOCK_SIZE;
+	for(size_t i = 0; i < num_images; i++)
+	{
+		if(ftruncate(image_fds[i], image_size) != 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+	Run fallocate with the given mode on `count` blocks starting at n_block, one stretch of the same image at a
+	time. Returns 0 if the host did all of it
+**/
+static int fallocate_blocks(int mode, size_t n_block, size_t count)
+{
+	for(size_t i = 0; i < count; )
+	{
+		off_t offset;
+		size_t n_image = map_block(n_block + i, &offset);
+
+		//The rest of the stripe unit is contiguous on the same image
+		size_t run = num_images == 1 ? count - i : stripe_unit - (n_block + i) % stripe_unit;
+		if(run > count - i)
+		{
+			run = count - i;
+		}
+		if(fallocate(image_fds[n_image], mode, offset, (off_t)run * BLOCK_SIZE) != 0)
+		{
+			return -1;
+		}
+		i += run;
+	}
+	return 0;
+}
+
+/**
+	Read `count` blocks, each into its own buffer. Blocks that follow each other on an image are read with a
+	single preadv, and on a striped disk big reads hand every image but the first to its reader thread so every
+	image is read at once.
+	Returns 0, or -EIO if any of the blocks doesn't match its checksum
+**/
+static int read_blocks(struct block_io *io, size_t count)
+{
+	if(count == 0)
+	{
+		return 0;
+	}
+
+	//In O_DIRECT mode everything has to go through the page cache, and with -o shared every block is already in
+	//memory, in the image's mapping
+	int res = 0;
+	if(options.odirect || image_maps[0])
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			if(read_block(io[i].n_block, io[i].buf) != 0)
+			{
+				res = -EIO;
+			}
+		}
+		return res;
+	}
+
+	struct image_read work[MAX_IMAGES];
+	for(size_t i = 0; i < num_images; i++)
+	{
+		work[i].n_image = i;
+		work[i].io = io;
+		work[i].count = count;
+		work[i].failed = 0;
+		work[i].done = 0;
+		work[i].next = NULL;
+	}
+
+	//Threads only pay off when the read spans several stripe units
+	if(num_images == 1 || count < 2 * stripe_unit)
+	{
+		for(size_t i = 0; i < num_images; i++)
+		{
+			read_image_blocks(&work[i]);
+			if(work[i].failed)
+			{
+				res = -EIO;
+			}
+		}
+		return res;
+	}
+
+	//Queue the other images for their reader threads while this one reads the first. An image whose reader
+	//couldn't be started is read here instead
+	for(size_t i = 1; i < num_images; i++)
+	{
+		struct image_reader *reader = &image_readers[i];
+		if(!reader->started)
+		{
+			read_image_blocks(&work[i]);
+			continue;
+		}
+		pthread_mutex_lock(&reader->lock);
+		if(reader->tail)
+		{
+			reader->tail->next = &work[i];
+		}
+		else
+		{
+			reader->head = &work[i];
+		}
+		reader->tail = &work[i];
+		pthread_cond_signal(&reader->work);
+		pthread_mutex_unlock(&reader->lock);
+	}
+	read_image_blocks(&work[0]);
+	for(size_t i = 0; i < num_images; i++)
+	{
+		struct image_reader *reader = &image_readers[i];
+		if(i > 0 && reader->started)
+		{
+			pthread_mutex_lock(&reader->lock);
+			while(!work[i].done)
+			{
+				pthread_cond_wait(&reader->done, &reader->lock);
+			}
+			pthread_mutex_unlock(&reader->lock);
+		}
+		if(work[i].failed)
+		{
+			res = -EIO;
+		}
+	}
+	return res;
+}
+
+/**
+	Read a run of blocks that follow each other on one image with a single preadv. Anything past the end of
+	the image reads as zeros
+**/
+static void read_run(int fd, struct iovec *iov, size_t n_iov, off_t offset)
+{
+	ssize_t res = preadv(fd, iov, n_iov, offset);
+	size_t done = res > 0 ? res : 0;
+	for(size_t i = 0; i < n_iov; i++)
+	{
+		if(done >= BLOCK_SIZE)
+		{
+			done -= BLOCK_SIZE;
+			continue;
+		}
+		memset((char*)iov[i].iov_base + done, 0, BLOCK_SIZE - done);
+		done = 0;
+	}
+}
+
+/**
+	Read the blocks of a read_blocks call that live on one image(A struct image_read). Runs on the image's
+	reader thread on striped disks
+**/
+static void *read_image_blocks(void *arg)
+{
+	struct image_read *work = arg;
+	int fd = image_fds[work->n_image];
+	struct iovec iov[READ_RUN_MAX];
+	size_t n_iov = 0;
+	off_t run_start = 0;
+	off_t next = 0;
+
+	for(size_t i = 0; i < work->count; i++)
+	{
+		off_t offset;
+		if(map_block(work->io[i].n_block, &offset) != work->n_image)
+		{
+			continue;
+		}
+
+		//Read what we have so far if this block doesn't directly follow the last one
+		if(n_iov > 0 && (offset != next || n_iov == READ_RUN_MAX))
+		{
+			read_run(fd, iov, n_iov, run_start);
+			n_iov = 0;
+		}
+		if(n_iov == 0)
+		{
+			run_start = offset;
+		}
+		iov[n_iov].iov_base = work->io[i].buf;
+		iov[n_iov].iov_len = BLOCK_SIZE;
+		n_iov++;
+		next = offset + BLOCK_SIZE;
+	}
+	if(n_iov > 0)
+	{
+		read_run(fd, iov, n_iov, run_start);
+	}
+
+	//Check everything once it's all been read
+	for(size_t i = 0; block_crcs && i < work->count; i++)
+	{
+		off_t offset;
+		if(map_block(work->io[i].n_block, &offset) == work->n_image && checksum_verify(work->io[i].n_block, work->io[i].buf) != 0)
+		{
+			work->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+/**
+	Start a reader thread for every image but the first of a striped disk, which the thread calling read_blocks
+	reads itself. They're only needed when read_blocks reads the images with preadv. An image whose thread can't
+	be started is read on the calling thread instead
+**/
+static void start_image_readers(void)
+{
+	if(num_images == 1 || options.odirect || image_maps[0])
+	{
+		return;
+	}
+	for(size_t i = 1; i < num_images; i++)
+	{
+		struct image_reader *reader = &image_readers[i];
+		pthread_mutex_init(&reader->lock, NULL);
+		pthread_cond_init(&reader->work, NULL);
+		pthread_cond_init(&reader->done, NULL);
+		reader->head = NULL;
+		reader->tail = NULL;
+		reader->stopping = 0;
+		reader->started = pthread_create(&reader->thread, NULL, run_image_reader, reader) == 0;
+		if(!reader->started)
+		{
+			fprintf(stderr, "cs1550: can't start a reader for image %zu, reading it inline\n", i);
+		}
+	}
+}
+
+/**
+	Stop the reader threads started by start_image_readers, once they're done with what's queued
+**/
+static void stop_image_readers(void)
+{
+	for(size_t i = 1; i < MAX_IMAGES; i++)
+	{
+		struct image_reader *reader = &image_readers[i];
+		if(!reader->started)
+		{
+			continue;
+		}
+		pthread_mutex_lock(&reader->lock);
+		reader->stopping = 1;
+		pthread_cond_signal(&reader->work);
+		pthread_mutex_unlock(&reader->lock);
+		pthread_join(reader->thread, NULL);
+		pthread_mutex_destroy(&reader->lock);
+		pthread_cond_destroy(&reader->work);
+		pthread_cond_destroy(&reader->done);
+		reader->started = 0;
+	}
+}
+
+/**
+	Body of an image's reader thread(A struct image_reader). Reads what's queued for it in order, until it's
+	stopped
+**/
+static void *run_image_reader(void *arg)
+{
+	struct image_reader *reader = arg;
+	pthread_mutex_lock(&reader->lock);
+	for(;;)
+	{
+		while(!reader->head && !reader->stopping)
+		{
+			pthread_cond_wait(&reader->work, &reader->lock);
+		}
+		struct image_read *work = reader->head;
+		if(!work)
+		{
+			break;
+		}
+		reader->head = work->next;
+		if(!reader->head)
+		{
+			reader->tail = NULL;
+		}
+		pthread_mutex_unlock(&reader->lock);
+
+		read_image_blocks(work);
+
+		pthread_mutex_lock(&reader->lock);
+		work->done = 1;
+		pthread_cond_broadcast(&reader->done);
+	}
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+/**
+	Score how fragmented a file is, from 0 when its data blocks all follow each other on the disk to 100 when
+	none of them do. Holes don't count either way
+**/
+static unsigned int fragmentation_score(const struct cs1550_index_block *index)
+{
+	size_t num_blocks = 0;
+	size_t num_breaks = 0;
+	size_t prev = 0;
+	for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+	{
+		if(index->entries[i] == 0)
+		{
+			continue;
+		}
+		if(num_blocks > 0 && index->entries[i] != prev + 1)
+		{
+			num_breaks++;
+		}
+		prev = index->entries[i];
+		num_blocks++;
+	}
+	return num_blocks < 2 ? 0 : num_breaks * 100 / (num_blocks - 1);
+}
+
+/**
+	Move a file's blocks into one contiguous run if its fragmentation score is high enough. The data is copied
+	to the new run behind a new index block, and only then is the file's directory entry switched over to it, so
+	the file is never seen half moved. Files that can't be given a long enough run, or that there's no memory to
+	move, are left where they are
+**/
+static void defrag_file(struct dir_path *path, struct cs1550_directory_entry *dir, size_t n_file)
+{
+	struct cs1550_file_entry *file = &dir->files[n_file];
+
+	//The directory block is rewritten below, so it can't be one a snapshot is using
+	if(cow_file(path, dir, NULL) != 0)
+	{
+		return;
+	}
+	size_t n_dir_block = path->blocks[path->depth];
+
+	//Place any buffered data first, so all of it gets moved
+	delalloc_flush(delalloc_find(file->n_index_block));
+
+	//A corrupt index block would have us copy and free blocks that aren't the file's, so leave the file alone
+	struct cs1550_index_block *index = block_buf_alloc();
+	struct cs1550_index_block *new_index = block_buf_alloc();
+	if(!index || !new_index || read_block(file->n_index_block, index) != 0)
+	{
+		block_buf_free(index);
+		block_buf_free(new_index);
+		return;
+	}
+	unsigned int threshold = options.defrag_score ? options.defrag_score : DEFAULT_DEFRAG_SCORE;
+	if(fragmentation_score(index) < threshold)
+	{
+		block_buf_free(index);
+		block_buf_free(new_index);
+		return;
+	}
+
+	size_t num_blocks = 0;
+	for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+	{
+		num_blocks += index->entries[i] != 0;
+	}
+
+	//The new index block goes right in front of the data, so reading the file is one sweep across the disk.
+	//Blocks promised to buffered writes are off limits
+	size_t n_start = blocks_available() > num_blocks ? alloc_blocks_near(num_blocks + 1, path->blocks[path->depth]) : 0;
+	if(n_start == 0)
+	{
+		block_buf_free(index);
+		block_buf_free(new_index);
+		return;
+	}
+
+	//Copy the data over DEFRAG_CHUNK_BLOCKS at a time, however big the file is
+	struct block_io io[DEFRAG_CHUNK_BLOCKS];
+	unsigned char data[DEFRAG_CHUNK_BLOCKS * BLOCK_SIZE];
+	size_t n_io = 0;
+	size_t n_copied = 0;
+	memset(new_index, 0, sizeof(struct cs1550_index_block));
+	for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+	{
+		if(index->entries[i] != 0)
+		{
+			io[n_io].n_block = index->entries[i];
+			io[n_io].buf = data + n_io * BLOCK_SIZE;
+			new_index->entries[i] = n_start + 1 + n_copied + n_io;
+			n_io++;
+		}
+		if(n_io == 0 || (n_io < DEFRAG_CHUNK_BLOCKS && n_copied + n_io < num_blocks))
+		{
+			continue;
+		}
+
+		//Leave a file with corrupt blocks where it is, rather than giving the bad data a fresh checksum
+		if(read_blocks(io, n_io) != 0)
+		{
+			for(size_t j = 0; j <= num_blocks; j++)
+			{
+				free_block(n_start + j);
+			}
+			block_buf_free(index);
+			block_buf_free(new_index);
+			return;
+		}
+		for(size_t j = 0; j < n_io; j++)
+		{
+			write_block(n_start + 1 + n_copied + j, data + j * BLOCK_SIZE);
+		}
+		n_copied += n_io;
+		n_io = 0;
+	}
+	write_block(n_start, new_index);
+
+	//Make sure the copy is on the disk before anything points to it
+	for(size_t i = 0; i < num_images; i++)
+	{
+		fdatasync(image_fds[i]);
+	}
+
+	//Switch the file over. It's one block write, so the file is either all in its old place or all in its new one
+	size_t n_old_index = file->n_index_block;
+	file->n_index_block = n_start;
+	write_block(n_dir_block, dir);
+	write_block(0, root);
+
+	//Now the old blocks can go
+	for(size_t i = 0; i < MAX_ENTRIES_IN_INDEX_BLOCK; i++)
+	{
+		if(index->entries[i] != 0)
+		{
+			free_block(index->entries[i]);
+		}
+	}
+	free_block(n_old_index);
+
+	block_buf_free(index);
+	block_buf_free(new_index);
+}
+
+/**
+	Load the checksums of every block from the checksum file with -o checksum, creating it if it doesn't exist.
+	It sits next to the disk's first image, as .disk.crc for .disk. Blocks written before checksums were turned on
+	have none, and are only checked once they've been written again
+**/
+static void checksum_open(void)
+{
+	if(!options.checksum)
+	{
+		return;
+	}
+
+	//Use the crc32 instruction when the CPU has it, and slicing-by-8 tables otherwise
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		for(int t = 1; t < 8; t++)
+		{
+			crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+		}
+	}
+	crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2"))
+	{
+		crc32c_update = crc32c_hw;
+	}
+#endif
+
+	char path[4096];
+	const char *image = options.stripe ? options.stripe : ".disk";
+	snprintf(path, sizeof(path), "%.*s.crc", (int)strcspn(image, ":"), image);
+	crc_fd = open(path, read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if(crc_fd < 0)
+	{
+		fprintf(stderr, "cs1550: can't open %s, not checking blocks: %s\n", path, strerror(errno));
+		return;
+	}
+
+	//Sized for the largest the disk can grow to. Anything the file doesn't have yet has no checksum
+	block_crcs = calloc(max_blocks, sizeof(uint32_t));
+	pread(crc_fd, block_crcs, max_blocks * sizeof(uint32_t), 0);
+}
+
+/**
+	Close the checksum file
+**/
+static void checksum_close(void)
+{
+	free(block_crcs);
+	block_crcs = NULL;
+	if(crc_fd >= 0)
+	{
+		close(crc_fd);
+		crc_fd = -1;
+	}
+}
+
+/**
+	Return the CRC32C of a block. A checksum of 0 means "none", so a block that really sums to 0 gets 1 instead
+**/
+static uint32_t block_checksum(const void *buf)
+{
+	uint32_t crc = ~crc32c_update(~0U, buf, BLOCK_SIZE);
+	return crc != 0 ? crc : 1;
+}
+
+/**
+	Record the checksum of a block that was just written
+**/
+static void checksum_store(size_t n_block, const void *buf)
+{
+	if(!block_crcs)
+	{
+		return;
+	}
+	block_crcs[n_block] = block_checksum(buf);
+	pwrite(crc_fd, &block_crcs[n_block], sizeof(uint32_t), n_block * sizeof(uint32_t));
+}
+
+/**
+	Check a block that was just read against its checksum. Returns 0 if it matches or it has none, and -EIO if
+	it doesn't match
+**/
+static int checksum_verify(size_t n_block, const void *buf)
+{
+	if(!block_crcs || block_crcs[n_block] == 0 || block_crcs[n_block] == block_checksum(buf))
+	{
+		return 0;
+	}
+	fprintf(stderr, "cs1550: block %zu doesn't match its checksum\n", n_block);
+	return -EIO;
+}
+
+/**
+	Drop the checksums of `count` blocks starting at n_block after they were zeroed without going through
+	write_block
+**/
+static void checksum_forget(size_t n_block, size_t count)
+{
+	if(!block_crcs)
+	{
+		return;
+	}
+	memset(&block_crcs[n_block], 0, count * sizeof(uint32_t));
+	pwrite(crc_fd, &block_crcs[n_block], count * sizeof(uint32_t), n_block * sizeof(uint32_t));
+}
+
+/**
+	Add buf to a running CRC32C eight bytes at a time using slicing-by-8 tables. Assumes a little endian CPU
+**/
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	while(len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, buf, 8);
+		word ^= crc;
+		crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+			crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+			crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+			crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while(len-- > 0)
+	{
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+/**
+	Add buf to a running CRC32C with SSE4.2's crc32 instruction, eight bytes at a time
+**/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t crc64 = crc;
+	while(len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, buf, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		buf += 8;
+		len -= 8;
+	}
+	crc = crc64;
+	while(len-- > 0)
+	{
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+	return crc;
+}
+#endif
+
+/**
+	Mark every block a tree points to as in use: its directory blocks, and every file's index and data blocks.
+	The tree is either the live root or a snapshot's copy of it. A snapshot's blocks are marked frozen too
+**/
+static void mark_tree(const struct cs1550_root_directory *tree, int frozen)
+{
+	for(size_t i = 0; i < tree->num_directories; i++)
+	{
+		if(is_snapshot(tree->directories[i].dname))
+		{
+			continue;
+		}
+		mark_dir_blocks(tree->directories[i].n_start_block, 0, 0, frozen);
+	}
+}
+
+/**
+	Mark a block of a directory's B-tree as in use, along with everything below it, directories nested in it
+	included(See mark_tree). depth is how many nodes are above it and nesting how many directories, so a corrupt
+	node or entry can't send us around in circles
+**/
+static void mark_dir_blocks(size_t n_block, size_t depth, size_t nesting, int frozen)
+{
+	union dir_block block;
+	mark_block_used(n_block);
+	if(frozen)
+	{
+		mark_block_frozen(n_block);
+	}
+	read_dir_block(n_block, &block);
+
+	if(block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		size_t num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+		if(depth >= DIR_MAX_DEPTH || num_keys > MAX_KEYS_IN_DIR_NODE)
+		{
+			return;
+		}
+		for(size_t i = 0; i <= num_keys; i++)
+		{
+			mark_dir_blocks(block.node.children[i], depth + 1, nesting, frozen);
+		}
+		return;
+	}
+
+	struct cs1550_directory_entry *dir = &block.dir;
+	struct cs1550_index_block index;
+	for(size_t j = 0; j < dir->num_files && j < MAX_FILES_IN_DIR; j++)
+	{
+		//A directory nested in this one is marked like any other. One whose first block is already marked is
+		//either a corrupt entry leading back up the tree or, in a snapshot, already frozen
+		if(dir->files[j].fsize & FILE_IS_DIRECTORY)
+		{
+			size_t n_sub = dir->files[j].n_index_block;
+			if(!frozen)
+			{
+				num_dirs++;
+			}
+			if(nesting + 1 < MAX_PATH_DEPTH && n_sub < total_blocks && !(frozen ? block_frozen(n_sub) : block_in_use(n_sub)))
+			{
+				mark_dir_blocks(n_sub, 0, nesting + 1, frozen);
+			}
+			continue;
+		}
+
+		if(!frozen)
+		{
+			num_files++;
+		}
+		mark_block_used(dir->files[j].n_index_block);
+		if(frozen)
+		{
+			mark_block_frozen(dir->files[j].n_index_block);
+		}
+		read_block(dir->files[j].n_index_block, &index);
+		for(size_t k = 0; k < MAX_ENTRIES_IN_INDEX_BLOCK; k++)
+		{
+			if(index.entries[k] != 0)
+			{
+				mark_block_used(index.entries[k]);
+				if(frozen)
+				{
+					mark_block_frozen(index.entries[k]);
+				}
+			}
+		}
+	}
+}
+
+/**
+	Mark a block as belonging to a snapshot
+**/
+static void mark_block_frozen(size_t n_block)
+{
+	if(n_block < total_blocks && !block_frozen(n_block))
+	{
+		frozen_bitmap[n_block / 8] |= 1 << (n_block % 8);
+		log_segments[n_block / LOG_SEGMENT_BLOCKS].frozen++;
+	}
+}
+
+/**
+	Check if a block belongs to a snapshot, in which case it must not be changed or freed
+**/
+static int block_frozen(size_t n_block)
+{
+	return frozen_bitmap && n_block < total_blocks && ((frozen_bitmap[n_block / 8] >> (n_block % 8)) & 1);
+}
+
+/**
+	Check if a block can be changed where it is. Blocks that belong to a snapshot never can. In log mode only the
+	blocks in the segment the log is filling can, anything older is written again at the head of the log
+**/
+static int block_writable(size_t n_block)
+{
+	if(block_frozen(n_block))
+	{
+		return 0;
+	}
+	return !options.log || n_block / LOG_SEGMENT_BLOCKS == log_head / LOG_SEGMENT_BLOCKS;
+}
+
+/**
+	Check if a name in the root is a snapshot's
+**/
+static int is_snapshot(const char *name)
+{
+	return name[0] == SNAPSHOT_PREFIX;
+}
+
+/**
+	Return the block holding the root of the snapshot with the given name(Including its SNAPSHOT_PREFIX), or 0
+	if there is no such snapshot
+**/
+static size_t find_snapshot(const char *name)
+{
+	for(size_t i = 0; i < root->num_directories; i++)
+	{
+		if(is_snapshot(root->directories[i].dname) && strcmp(name, root->directories[i].dname) == 0)
+		{
+			return root->directories[i].n_start_block;
+		}
+	}
+	return 0;
+}
+
+/**
+	Take a snapshot of the filesystem. The root is copied to a new block, minus any other snapshots, and
+	everything it points to is frozen: the live filesystem copies a frozen block before changing it, so the
+	snapshot keeps seeing the filesystem as it is now. Nothing but the root is copied up front
+**/
+static int create_snapshot(const char *name)
+{
+	if(root->num_directories >= MAX_DIRS_IN_ROOT || blocks_available() < 1)
+	{
+		return -ENOSPC;
+	}
+
+	//Data that's still buffered belongs in the snapshot too
+	delalloc_flush_all();
+
+	struct cs1550_root_directory *snapshot = calloc(1, sizeof(struct cs1550_root_directory));
+	snapshot->last_allocated_block = root->last_allocated_block;
+	for(size_t i = 0; i < root->num_directories; i++)
+	{
+		if(!is_snapshot(root->directories[i].dname))
+		{
+			snapshot->directories[snapshot->num_directories++] = root->directories[i];
+		}
+	}
+	size_t n_block = alloc_blocks(1);
+	write_block(n_block, snapshot);
+
+	strncpy(root->directories[root->num_directories].dname, name, (MAX_FILENAME + 1));
+	root->directories[root->num_directories].n_start_block = n_block;
+	root->num_directories++;
+	write_block(0, root);
+
+	mark_block_frozen(n_block);
+	mark_tree(snapshot, 1);
+	free(snapshot);
+	return 0;
+}
+
+/**
+	Remove a snapshot. The blocks that only it was using are found by working out the used and frozen blocks
+	again from what's left, and are given back
+**/
+static int delete_snapshot(const char *name)
+{
+	for(size_t i = 0; i < root->num_directories; i++)
+	{
+		if(is_snapshot(root->directories[i].dname) && strcmp(name, root->directories[i].dname) == 0)
+		{
+			memmove(&root->directories[i], &root->directories[i + 1], (root->num_directories - i - 1) * sizeof(struct cs1550_directory));
+			root->num_directories--;
+			memset(&root->directories[root->num_directories], 0, sizeof(struct cs1550_directory));
+			write_block(0, root);
+
+			build_block_bitmap();
+			trim_free_space();
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/**
+	Copy a block that can't be changed where it is to a newly allocated one that can. Returns the new block, or 0
+	if there's no space for it or the block doesn't match its checksum, so a corrupt block isn't given a fresh one
+**/
+static size_t copy_block(size_t n_block)
+{
+	if(blocks_available() < 1)
+	{
+		return 0;
+	}
+	struct cs1550_data_block *data = block_buf_alloc();
+	if(read_block(n_block, data) != 0)
+	{
+		block_buf_free(data);
+		return 0;
+	}
+	size_t n_copy = alloc_blocks_near(1, n_block);
+	write_block(n_copy, data);
+	block_buf_free(data);
+	return n_copy;
+}
+
+/**
+	Make sure the blocks on a path through a directory's B-tree, and the index block of one of its files if
+	`file` isn't null, can be changed. Any that can't be changed where they are(See block_writable) are copied,
+	whatever points to them is updated to point to the copy, and the old block is let go. `dir` is the caller's
+	copy of the directory block at the end of the path and `file` one of its entries. Returns 0, or -ENOSPC if
+	there's no space for the copies or a block doesn't match its checksum(See copy_block).
+
+	Writing to a file calls this first, so delalloc_flush can write the index block in place. Buffered data is
+	kept by index block, so it follows the file to its copy
+**/
+static int cow_file(struct dir_path *path, struct cs1550_directory_entry *dir, struct cs1550_file_entry *file)
+{
+	//Copy from the top down, so each copy is pointed to by a block that can already be changed
+	for(size_t level = 0; level <= path->depth; level++)
+	{
+		size_t n_old = path->blocks[level];
+		if(block_writable(n_old))
+		{
+			continue;
+		}
+		size_t n_new = copy_block(n_old);
+		if(n_new == 0)
+		{
+			return -ENOSPC;
+		}
+		if(level == 0)
+		{
+			if(set_start_block(path->dir, path->dir_len, n_new) != 0)
+			{
+				free_block(n_new);
+				return -ENOSPC;
+			}
+		}
+		else
+		{
+			union dir_block parent;
+			read_dir_block(path->blocks[level - 1], &parent);
+			parent.node.children[path->slots[level - 1]] = n_new;
+			write_block(path->blocks[level - 1], &parent);
+		}
+		path->blocks[level] = n_new;
+		free_block(n_old);
+	}
+	size_t n_dir_block = path->blocks[path->depth];
+
+	if(file && !block_writable(file->n_index_block))
+	{
+		size_t n_old = file->n_index_block;
+		size_t n_index_block = copy_block(n_old);
+		if(n_index_block == 0)
+		{
+			return -ENOSPC;
+		}
+		file->n_index_block = n_index_block;
+		write_block(n_dir_block, dir);
+		free_block(n_old);
+
+		struct dirty_file *dirty = delalloc_find(n_old);
+		if(dirty)
+		{
+			dirty->n_index_block = n_index_block;
+		}
+	}
+	return 0;
+}
+
+/**
+	Return the first segment after n_segment, wrapping around, that has no blocks in use, or 0 if there is none.
+	Segment 0 holds the root, so it is never clean
+**/
+static size_t log_find_clean_segment(size_t n_segment)
+{
+	size_t num_segments = (max_blocks + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+	for(size_t i = 1; i < num_segments; i++)
+	{
+		size_t n_next = (n_segment + i) % num_segments;
+		if(n_next != 0 && log_segments[n_next].used == 0)
+		{
+			return n_next;
+		}
+	}
+	return 0;
+}
+
+/**
+	Allocate `count` contiguous blocks at the head of the log and return the first one. When they don't fit in
+	the segment being filled, the log moves on to the next clean segment, growing the disk into it if needed.
+	Returns 0 if there's no clean segment left, in which case the caller falls back to any free run
+**/
+static size_t log_alloc(size_t count)
+{
+	if(count > LOG_SEGMENT_BLOCKS)
+	{
+		return 0;
+	}
+
+	//Try the segment being filled, then a clean one
+	for(int tries = 0; tries < 2; tries++)
+	{
+		size_t end = (log_head / LOG_SEGMENT_BLOCKS + 1) * LOG_SEGMENT_BLOCKS;
+		if(end > max_blocks)
+		{
+			end = max_blocks;
+		}
+		if(end > total_blocks && log_head + count <= end)
+		{
+			grow_disk(end - total_blocks);
+		}
+
+		size_t run = 0;
+		for(size_t n_block = log_head; n_block < end && n_block < total_blocks; n_block++)
+		{
+			if(n_block == 0 || block_in_use(n_block))
+			{
+				run = 0;
+			}
+			else if(++run == count)
+			{
+				size_t start = n_block - count + 1;
+				for(size_t i = start; i <= n_block; i++)
+				{
+					mark_block_used(i);
+				}
+				log_head = n_block + 1;
+				return start;
+			}
+		}
+
+		size_t n_segment = log_find_clean_segment(log_head / LOG_SEGMENT_BLOCKS);
+		if(n_segment == 0)
+		{
+			return 0;
+		}
+		log_head = n_segment * LOG_SEGMENT_BLOCKS;
+	}
+	return 0;
+}
+
+/**
+	Keep some segments clean for the log to move on to. When there are fewer than LOG_MIN_CLEAN_SEGMENTS, the
+	segment with the fewest blocks in use is emptied(See clean_segment). Segments holding snapshot blocks are
+	left alone, since those can't move, and so are ones the cleaner already failed to empty. Called after writes
+	and flushes in log mode, and cleans at most one segment each time so no single request waits long
+**/
+static void log_clean(void)
+{
+	//Segments the disk hasn't grown into yet are all clean, and counted as such
+	if(log_clean_segments >= LOG_MIN_CLEAN_SEGMENTS)
+	{
+		return;
+	}
+
+	size_t num_grown = (total_blocks + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+	size_t victim = 0;
+	size_t victim_used = LOG_CLEAN_MAX_LIVE + 1;
+	for(size_t n_segment = 1; n_segment < num_grown; n_segment++)
+	{
+		struct log_segment *segment = &log_segments[n_segment];
+		if(segment->used != 0 && n_segment != log_head / LOG_SEGMENT_BLOCKS && segment->frozen == 0 && !segment->stuck && segment->used < victim_used)
+		{
+			victim = n_segment;
+			victim_used = segment->used;
+		}
+	}
+
+	//Moving a block can take new copies of the index and directory blocks pointing to it as well
+	if(victim != 0 && blocks_available() >= 3 * victim_used)
+	{
+		clean_segment(victim);
+	}
+}
+
+/**
+	Empty a segment by writing every block in use in it again at the head of the log. The index and directory
+	blocks that point to moved blocks are written at the head too, and the root last. Old blocks are only freed
+	once the root no longer leads to them. Returns 0, -ENOMEM if there was no memory for the cleaner on mount,
+	-ENOSPC if the log ran out of space part way, or -EIO if a block didn't match its checksum. Directories
+	already moved stay moved, and the copies made for the one that failed are freed. A segment that can't be
+	emptied for any reason but space isn't picked again until it empties some other way
+**/
+static int clean_segment(size_t n_segment)
+{
+	struct log_pass pass;
+	pass.n_segment = n_segment;
+	pass.moves = log_moves;
+	if(!pass.moves)
+	{
+		return -ENOMEM;
+	}
+
+	for(size_t i = 0; i < root->num_directories; i++)
+	{
+		if(is_snapshot(root->directories[i].dname))
+		{
+			continue;
+		}
+
+		pass.num_moves = 0;
+		pass.err = 0;
+		size_t n_start_block = root->directories[i].n_start_block;
+		size_t n_new = clean_dir_blocks(n_start_block, 0, 0, &pass);
+		if(n_new == 0)
+		{
+			//Nothing leads to the copies made so far. Buffered data that followed an index block to its copy goes
+			//back to the old one before the copy is freed
+			for(size_t k = 0; k < pass.num_moves; k++)
+			{
+				struct dirty_file *dirty_data = delalloc_find(pass.moves[k].n_new);
+				if(dirty_data)
+				{
+					dirty_data->n_index_block = pass.moves[k].n_old;
+				}
+				free_block(pass.moves[k].n_new);
+			}
+			if(pass.err != -ENOSPC)
+			{
+				log_segments[n_segment].stuck = 1;
+			}
+			memset(dentry_cache, 0, sizeof(dentry_cache));
+			memset(negative_cache, 0, sizeof(negative_cache));
+			return pass.err;
+		}
+		if(n_new != n_start_block)
+		{
+			root->directories[i].n_start_block = n_new;
+			write_block(0, root);
+		}
+
+		for(size_t k = 0; k < pass.num_moves; k++)
+		{
+			free_block(pass.moves[k].n_old);
+		}
+	}
+
+	//Blocks left behind, such as those of a file whose index block fails its checksum, can't be moved by
+	//trying again
+	if(log_segments[n_segment].used != 0)
+	{
+		log_segments[n_segment].stuck = 1;
+	}
+
+	//Directories nested in others may have moved without their entries saying where from, so where they were
+	//cached is forgotten
+	memset(dentry_cache, 0, sizeof(dentry_cache));
+	memset(negative_cache, 0, sizeof(negative_cache));
+	return 0;
+}
+
+/**
+	Move everything under a block of a directory's B-tree out of the segment `pass` is emptying(See
+	clean_segment), directories nested in it included. Blocks that change or are in the segment are written again
+	at the head of the log, and recorded in `pass`. Returns the block's new number, which is n_block if it didn't
+	move, or 0 with the reason in pass->err if it couldn't be moved
+**/
+static size_t clean_dir_blocks(size_t n_block, size_t depth, size_t nesting, struct log_pass *pass)
+{
+	union dir_block block;
+	int dirty = 0;
+	read_dir_block(n_block, &block);
+
+	if(block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		size_t num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+		if(depth >= DIR_MAX_DEPTH || num_keys > MAX_KEYS_IN_DIR_NODE)
+		{
+			return n_block;
+		}
+		for(size_t i = 0; i <= num_keys; i++)
+		{
+			size_t n_child = clean_dir_blocks(block.node.children[i], depth + 1, nesting, pass);
+			if(n_child == 0)
+			{
+				return 0;
+			}
+			if(n_child != block.node.children[i])
+			{
+				block.node.children[i] = n_child;
+				dirty = 1;
+			}
+		}
+	}
+	else
+	{
+		struct cs1550_index_block index;
+		for(size_t j = 0; j < block.dir.num_files && j < MAX_FILES_IN_DIR; j++)
+		{
+			struct cs1550_file_entry *file = &block.dir.files[j];
+			if(file->fsize & FILE_IS_DIRECTORY)
+			{
+				size_t n_sub = nesting + 1 < MAX_PATH_DEPTH ? clean_dir_blocks(file->n_index_block, 0, nesting + 1, pass) : file->n_index_block;
+				if(n_sub == 0)
+				{
+					return 0;
+				}
+				if(n_sub != file->n_index_block)
+				{
+					file->n_index_block = n_sub;
+					dirty = 1;
+				}
+				continue;
+			}
+
+			int index_dirty = 0;
+			if(read_block(file->n_index_block, &index) != 0)
+			{
+				continue;
+			}
+
+			for(size_t k = 0; k < MAX_ENTRIES_IN_INDEX_BLOCK; k++)
+			{
+				if(index.entries[k] != 0 && index.entries[k] / LOG_SEGMENT_BLOCKS == pass->n_segment)
+				{
+					size_t n_copy = copy_block(index.entries[k]);
+					if(n_copy == 0)
+					{
+						//With space left, copy_block only refuses a block that fails its checksum
+						pass->err = blocks_available() > 0 ? -EIO : -ENOSPC;
+						return 0;
+					}
+					pass->moves[pass->num_moves].n_old = index.entries[k];
+					pass->moves[pass->num_moves++].n_new = n_copy;
+					index.entries[k] = n_copy;
+					index_dirty = 1;
+				}
+			}
+
+			if(index_dirty || file->n_index_block / LOG_SEGMENT_BLOCKS == pass->n_segment)
+			{
+				size_t n_index_block = alloc_blocks(1);
+				if(n_index_block == 0)
+				{
+					pass->err = -ENOSPC;
+					return 0;
+				}
+				write_block(n_index_block, &index);
+				pass->moves[pass->num_moves].n_old = file->n_index_block;
+				pass->moves[pass->num_moves++].n_new = n_index_block;
+
+				//Buffered data follows the file to its new index block
+				struct dirty_file *dirty_data = delalloc_find(file->n_index_block);
+				if(dirty_data)
+				{
+					dirty_data->n_index_block = n_index_block;
+				}
+				file->n_index_block = n_index_block;
+				dirty = 1;
+			}
+		}
+	}
+
+	if(!dirty && n_block / LOG_SEGMENT_BLOCKS != pass->n_segment)
+	{
+		return n_block;
+	}
+	size_t n_new = alloc_blocks(1);
+	if(n_new == 0)
+	{
+		pass->err = -ENOSPC;
+		return 0;
+	}
+	write_block(n_new, &block);
+	pass->moves[pass->num_moves].n_old = n_block;
+	pass->moves[pass->num_moves++].n_new = n_new;
+	return n_new;
+}
+
+/**
+	Start recording calls to the trace file given with -o trace, replacing anything already in it
+**/
+static void trace_open(void)
+{
+	if(!options.trace)
+	{
+		return;
+	}
+	trace_fd = open(options.trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(trace_fd < 0)
+	{
+		fprintf(stderr, "cs1550: can't open %s, not tracing: %s\n", options.trace, strerror(errno));
+		return;
+	}
+	struct trace_header header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	trace_buf = malloc(TRACE_BUFFER_SIZE);
+	if(!trace_buf)
+	{
+		fprintf(stderr, "cs1550: no memory for the trace buffer, not tracing\n");
+		close(trace_fd);
+		trace_fd = -1;
+		return;
+	}
+	memcpy(trace_buf, &header, sizeof(header));
+	trace_len = sizeof(header);
+	trace_start = trace_now();
+}
+
+/**
+	Write out the records still in memory and close the trace file
+**/
+static void trace_close(void)
+{
+	if(trace_fd < 0 || trace_write_out() != 0)
+	{
+		return;
+	}
+	close(trace_fd);
+	trace_fd = -1;
+	free(trace_buf);
+	trace_buf = NULL;
+}
+
+/**
+	Write the records in memory to the trace file. If it can't all be written, the trace is cut short there and
+	tracing stops. Returns 0, or -1 if tracing stopped
+**/
+static int trace_write_out(void)
+{
+	size_t done = 0;
+	while(done < trace_len)
+	{
+		ssize_t res = write(trace_fd, trace_buf + done, trace_len - done);
+		if(res < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(res <= 0)
+		{
+			fprintf(stderr, "cs1550: can't write to %s, not tracing any more: %s\n", options.trace, res < 0 ? strerror(errno) : "nothing written");
+			close(trace_fd);
+			trace_fd = -1;
+			free(trace_buf);
+			trace_buf = NULL;
+			trace_len = 0;
+			return -1;
+		}
+		done += res;
+	}
+	trace_len = 0;
+	return 0;
+}
+
+/**
+	Return the time in nanoseconds on a clock that only goes forward
+**/
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+	Add a call made at `time` to the trace. Records are gathered in memory and written a buffer at a time, so
+	tracing costs one write per TRACE_BUFFER_SIZE bytes rather than one per call
+**/
+static void trace_record(uint8_t op, const char *path, const char *path2, uint64_t offset, uint64_t size, uint32_t arg, int result, uint64_t time)
+{
+	if(trace_fd < 0)
+	{
+		return;
+	}
+
+	size_t path_len = strlen(path);
+	size_t path2_len = path2 ? strlen(path2) + 1 : 0;
+	struct trace_record rec;
+	rec.time = time - trace_start;
+	rec.offset = offset;
+	rec.size = size;
+	rec.arg = arg;
+	rec.result = result;
+	rec.op = op;
+	rec.path_len = path_len + path2_len;
+	if(trace_len + sizeof(rec) + rec.path_len > TRACE_BUFFER_SIZE && trace_write_out() != 0)
+	{
+		return;
+	}
+
+	memcpy(trace_buf + trace_len, &rec, sizeof(rec));
+	trace_len += sizeof(rec);
+	memcpy(trace_buf + trace_len, path, path_len);
+	trace_len += path_len;
+	if(path2)
+	{
+		trace_buf[trace_len++] = '\0';
+		memcpy(trace_buf + trace_len, path2, path2_len - 1);
+		trace_len += path2_len - 1;
+	}
+}
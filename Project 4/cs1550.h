@@ -2,6 +2,7 @@
 #define CS1550_H
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 
 /* Size of a disk block */
@@ -29,13 +30,22 @@ struct PACKED cs1550_file_entry {
 	/* File extension, plus extra space for the null terminator */
 	char fext[MAX_EXTENSION + 1];
 
-	/* Size of the file, in bytes */
+	/* Size of the file, in bytes, or FILE_IS_DIRECTORY for a subdirectory */
 	size_t fsize;
 
-	/* Block number of the file's index block in the `.disk` file */
+	/* Block number of the file's index block in the `.disk` file, or the
+	 * subdirectory's first block */
 	size_t n_index_block;
 };
 
+/* Set in a file entry's fsize when the entry is a directory nested in this one
+ * rather than a file. Its files are found the same way as in a directory in
+ * the root, starting from n_index_block */
+#define FILE_IS_DIRECTORY	((size_t)1 << (8 * sizeof(size_t) - 1))
+
+/* Most directories a path can go through, counting the one in the root */
+#define MAX_PATH_DEPTH	64
+
 struct cs1550_directory_entry {
 	/* Number of files in directory. Must be less than MAX_FILES_IN_DIR */
 	size_t num_files;
@@ -49,6 +59,45 @@ struct cs1550_directory_entry {
 
 
 
+/*
+ * Directories with more files than fit in one directory block are B-trees,
+ * ordered by file name and then extension. Directory blocks are the leaves,
+ * and the directory's first block, once it fills up, becomes a node pointing
+ * to the blocks below it.
+ */
+
+/* Set in a node's num_keys, so a node is never mistaken for a directory block */
+#define DIR_NODE_INTERIOR	((size_t)1 << (8 * sizeof(size_t) - 1))
+
+/* Most levels of nodes above a directory's blocks */
+#define DIR_MAX_DEPTH	12
+
+#define MAX_KEYS_IN_DIR_NODE ((BLOCK_SIZE - 2*sizeof(size_t)) / (sizeof(struct cs1550_dir_key) + sizeof(size_t)))
+#define DIR_NODE_PADDING (BLOCK_SIZE - 2*sizeof(size_t) - MAX_KEYS_IN_DIR_NODE*(sizeof(struct cs1550_dir_key) + sizeof(size_t)))
+
+struct PACKED cs1550_dir_key {
+	/* File name and extension, as in `struct cs1550_file_entry` */
+	char fname[MAX_FILENAME + 1];
+	char fext[MAX_EXTENSION + 1];
+};
+
+struct cs1550_dir_node {
+	/* Number of keys, with DIR_NODE_INTERIOR set */
+	size_t num_keys;
+
+	/* Block numbers of the nodes or directory blocks below. children[i] has
+	 * the files before keys[i], and children[num_keys] the rest */
+	size_t children[MAX_KEYS_IN_DIR_NODE + 1];
+
+	/* Where each child but the first starts */
+	struct cs1550_dir_key keys[MAX_KEYS_IN_DIR_NODE];
+
+	/* Padding so the node is one block large. Don't use this field. */
+	char __padding[DIR_NODE_PADDING];
+};
+
+
+
 /*
  * The root directory and all of its subdirectories.
  */
@@ -60,7 +109,8 @@ struct PACKED cs1550_directory {
 	/* Directory name, plus extra space for the null terminator */
 	char dname[MAX_FILENAME + 1];
 
-	/* Block number of the directory block in the `.disk` file */
+	/* Block number of the directory block in the `.disk` file, or of the top
+	 * node of the directory's B-tree */
 	size_t n_start_block;
 };
 
@@ -104,8 +154,14 @@ struct cs1550_data_block {
  */
 
 static_assert(sizeof(struct cs1550_directory_entry) == BLOCK_SIZE, "wrong size");
+static_assert(sizeof(struct cs1550_dir_node)        == BLOCK_SIZE, "wrong size");
 static_assert(sizeof(struct cs1550_root_directory)  == BLOCK_SIZE, "wrong size");
 static_assert(sizeof(struct cs1550_index_block)     == BLOCK_SIZE, "wrong size");
 static_assert(sizeof(struct cs1550_data_block)      == BLOCK_SIZE, "wrong size");
 
+/* A file's name and extension are next to each other, so lookups can compare
+ * them as one 13 byte key, and an entry is big enough to load 16 bytes of */
+static_assert(offsetof(struct cs1550_file_entry, fext) == MAX_FILENAME + 1, "name and extension must be adjacent");
+static_assert(sizeof(struct cs1550_file_entry) >= 16, "file entries must be at least 16 bytes");
+
 #endif // CS1550_H
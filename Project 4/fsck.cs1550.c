@@ -0,0 +1,1335 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cs1550.h"
+
+struct dir_tree;
+struct dir_rec;
+struct dir_task;
+
+//Helper functions
+static void problem(int fixable, const char *fmt, ...);
+static void read_block(size_t n_block, void *buf);
+static void write_block(size_t n_block, const void *buf);
+static int test_and_set(unsigned char *bitmap, size_t n_block);
+static int test_bit(const unsigned char *bitmap, size_t n_block);
+static void claim_block(size_t n_block);
+static void run_parallel(void (*task)(size_t), size_t count);
+static void *pool_worker(void *arg);
+static void check_root(void);
+static void walk_directories(void);
+static void *walk_worker(void *arg);
+static void queue_dir_block(size_t i, const char *dname, size_t n_block, size_t depth, size_t nesting, const struct cs1550_dir_key *low, const struct cs1550_dir_key *high, struct dir_rec *parent, size_t slot, int again);
+static void check_dir_block(struct dir_task *task);
+static void add_rec(size_t i, struct dir_rec *rec);
+static void order_tree(struct dir_tree *tree, struct dir_rec *rec);
+static int compare_slot(const void *a, const void *b);
+static int compare_key(const char *fname, const char *fext, const struct cs1550_dir_key *key);
+static void check_snapshot(size_t i);
+static void check_snapshot_block(const char *name, const char *dname, size_t n_block, size_t depth, size_t nesting);
+static void resolve_duplicates(void);
+static size_t find_free_block(void);
+static void drop_rec(struct dir_rec *rec);
+static void compact_rec(struct dir_rec *rec);
+static void remove_directory(size_t i);
+static void free_tree(struct dir_tree *tree);
+static void free_rec(struct dir_rec *rec);
+static void scan_chunk(size_t chunk);
+static int is_zero(const unsigned char *buf, size_t len);
+
+//Entries in the root whose name starts with this are snapshots. They point to a frozen copy of the root
+#define SNAPSHOT_PREFIX '@'
+
+//Blocks the leak scan hands to a thread at a time
+#define SCAN_CHUNK_BLOCKS 8192
+//Blocks read at once while scanning for leaks
+#define SCAN_READ_BLOCKS 256
+#define MAX_THREADS 64
+
+//Longest path of a directory, for messages
+#define MAX_DIR_PATH (MAX_PATH_DEPTH * (MAX_FILENAME + MAX_EXTENSION + 2))
+
+//Exit codes, the same as the other fsck tools use
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+//Our copy of a block of a directory's B-tree, along with the path of the directory it's in and what points to it:
+//child `slot` of an interior node, or entry `slot` of a directory block when it's the first block of a directory
+//nested there. Only the first block of a directory in the root has no parent
+struct dir_rec
+{
+	size_t n_block;
+	union
+	{
+		struct cs1550_dir_node node;
+		struct cs1550_directory_entry dir;
+	} block;
+	char *dname;
+	struct dir_rec *parent;
+	size_t slot;
+	struct dir_rec *children;
+	struct dir_rec *next;
+	int dropped;
+	int dirty;
+};
+
+//Our copy of a directory's B-tree, and those of the directories nested in it. `order` has every block, each
+//one before those below it, in the order of the names they hold
+struct dir_tree
+{
+	struct dir_rec *top;
+	struct dir_rec **order;
+	size_t num_order;
+};
+
+//A directory block waiting to be checked(See check_dir_block). Every name under it must be at least `low` and
+//less than `high`, unless has_low or has_high say there's no bound. claimed is set when whoever queued it
+//already marked it used, and again when it's in a directory that's already been checked through another entry
+struct dir_task
+{
+	size_t i;
+	char *dname;
+	size_t n_block;
+	size_t depth;
+	size_t nesting;
+	struct cs1550_dir_key low;
+	struct cs1550_dir_key high;
+	int has_low;
+	int has_high;
+	struct dir_rec *parent;
+	size_t slot;
+	int claimed;
+	int again;
+	struct dir_task *next;
+};
+
+//The tasks of one run_parallel call. Workers take the next task until there are none left
+struct task_pool
+{
+	void (*task)(size_t);
+	size_t count;
+	size_t next;
+};
+
+//The image being checked, its size in blocks, and whether problems get fixed
+static int disk_fd;
+static size_t total_blocks;
+static int repair;
+static size_t num_threads;
+//The image's checksum file(From mounting with -o checksum), if it has one
+static int crc_fd = -1;
+//Our copy of the root. Every directory's blocks are kept too, since resolving duplicates needs them again
+static struct cs1550_root_directory root;
+static struct dir_tree dirs[MAX_DIRS_IN_ROOT];
+static int root_dirty;
+//Directory blocks waiting to be checked, and how many are either waiting or being checked. Workers wait for more
+//until both run out
+static struct dir_task *dir_tasks;
+static size_t dir_tasks_left;
+static pthread_mutex_t dir_task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dir_task_cond = PTHREAD_COND_INITIALIZER;
+//Held while a block is added to our copy of a tree
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+//Blocks something points to, and blocks more than one thing points to. Set from many threads at once
+static unsigned char *used_bitmap;
+static unsigned char *dup_bitmap;
+static int found_dups;
+//Set when a directory has a node that can't be fixed. Whatever was under it looks leaked, but isn't
+static int tree_damaged;
+//Blocks snapshots point to. They're shared with the live filesystem and with each other, so they're kept apart
+static unsigned char *snapshot_bitmap;
+//Totals for the summary
+static size_t num_files;
+static size_t num_dirs;
+static size_t num_used;
+static size_t num_leaked;
+static size_t problems_found;
+static size_t problems_left;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Checks a disk image: fsck.cs1550 [-r] [-j THREADS] [IMAGE]
+ *
+ * The root, every directory's B-tree and every index block are checked, and a
+ * map of the blocks they point to is built on a pool of threads. Blocks that
+ * more than one thing points to are reported, as are free blocks that still
+ * hold data (leaked blocks). Nothing is changed unless -r is given, in which
+ * case bad entries are dropped, shared data blocks are copied so each file
+ * has its own, and leaked blocks are punched out of the image.
+ *
+ * Snapshots share blocks with the live filesystem by design, so their blocks
+ * are tracked apart from it. They're checked too, but never changed.
+ *
+ * The image must not be mounted while it is checked.
+ */
+int main(int argc, char *argv[])
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while((opt = getopt(argc, argv, "rj:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'r':
+				repair = 1;
+				break;
+			case 'j':
+				threads = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-r] [-j THREADS] [IMAGE]\n", argv[0]);
+				return FSCK_ERROR;
+		}
+	}
+	const char *image = optind < argc ? argv[optind] : ".disk";
+	num_threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : (size_t)threads;
+
+	disk_fd = open(image, repair ? O_RDWR : O_RDONLY);
+	if(disk_fd < 0)
+	{
+		fprintf(stderr, "%s: can't open %s: %s\n", argv[0], image, strerror(errno));
+		return FSCK_ERROR;
+	}
+
+	//Blocks we change lose their checksums, since we don't compute them
+	if(repair)
+	{
+		char crc_path[4096];
+		snprintf(crc_path, sizeof(crc_path), "%s.crc", image);
+		crc_fd = open(crc_path, O_RDWR);
+	}
+
+	//An empty image is a valid disk. The root is created the first time it's mounted
+	total_blocks = lseek(disk_fd, 0, SEEK_END) / BLOCK_SIZE;
+	if(total_blocks == 0)
+	{
+		printf("%s: empty disk\n", image);
+		close(disk_fd);
+		return FSCK_OK;
+	}
+	used_bitmap = calloc((total_blocks + 7) / 8, 1);
+	dup_bitmap = calloc((total_blocks + 7) / 8, 1);
+	snapshot_bitmap = calloc((total_blocks + 7) / 8, 1);
+
+	read_block(0, &root);
+	check_root();
+	claim_block(0);
+	walk_directories();
+	run_parallel(check_snapshot, root.num_directories);
+
+	//Sort out the blocks that are shared, then rebuild the map since dropped entries may have freed blocks
+	if(found_dups)
+	{
+		resolve_duplicates();
+		if(repair)
+		{
+			memset(used_bitmap, 0, (total_blocks + 7) / 8);
+			memset(dup_bitmap, 0, (total_blocks + 7) / 8);
+			num_used = 0;
+			num_files = 0;
+			num_dirs = 0;
+			claim_block(0);
+			walk_directories();
+		}
+	}
+
+	//Everything nothing points to should be zero
+	run_parallel(scan_chunk, (total_blocks + SCAN_CHUNK_BLOCKS - 1) / SCAN_CHUNK_BLOCKS);
+	if(num_leaked > 0)
+	{
+		problem(!tree_damaged, "%zu leaked blocks", num_leaked);
+	}
+
+	//The last allocated block is only a hint for where to allocate from, but keep it on the disk
+	size_t last_used = 0;
+	for(size_t n_block = total_blocks; n_block-- > 0; )
+	{
+		if(test_bit(used_bitmap, n_block) || test_bit(snapshot_bitmap, n_block))
+		{
+			last_used = n_block;
+			break;
+		}
+	}
+
+	//Blocks only snapshots use count as used too
+	for(size_t n_block = 0; n_block < total_blocks; n_block++)
+	{
+		if(test_bit(snapshot_bitmap, n_block) && !test_bit(used_bitmap, n_block))
+		{
+			num_used++;
+		}
+	}
+	if(root.last_allocated_block >= total_blocks || root.last_allocated_block < last_used)
+	{
+		root.last_allocated_block = last_used;
+		root_dirty = 1;
+	}
+	if(repair && root_dirty)
+	{
+		write_block(0, &root);
+	}
+	if(repair)
+	{
+		fsync(disk_fd);
+	}
+	close(disk_fd);
+	if(crc_fd >= 0)
+	{
+		close(crc_fd);
+	}
+
+	printf("%s: %zu directories, %zu files, %zu/%zu blocks\n", image, root.num_directories + num_dirs, num_files, num_used, total_blocks);
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		free_tree(&dirs[i]);
+	}
+	free(used_bitmap);
+	free(dup_bitmap);
+	free(snapshot_bitmap);
+	if(problems_left > 0)
+	{
+		return FSCK_UNCORRECTED;
+	}
+	return problems_found > 0 ? FSCK_CORRECTED : FSCK_OK;
+}
+
+/**
+	Report a problem with the disk. It counts as fixed if it can be and we're repairing
+**/
+static void problem(int fixable, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	pthread_mutex_lock(&report_lock);
+	vprintf(fmt, args);
+	if(repair && fixable)
+	{
+		printf(" (fixed)");
+	}
+	else
+	{
+		problems_left++;
+	}
+	printf("\n");
+	problems_found++;
+	pthread_mutex_unlock(&report_lock);
+	va_end(args);
+}
+
+/**
+	Read a block from the image. Anything past its end reads as zeros
+**/
+static void read_block(size_t n_block, void *buf)
+{
+	ssize_t res = pread(disk_fd, buf, BLOCK_SIZE, (off_t)n_block * BLOCK_SIZE);
+	if(res < BLOCK_SIZE)
+	{
+		memset((char*)buf + (res > 0 ? res : 0), 0, BLOCK_SIZE - (res > 0 ? res : 0));
+	}
+}
+
+/**
+	Write a block to the image, and drop its checksum if it has one
+**/
+static void write_block(size_t n_block, const void *buf)
+{
+	if(pwrite(disk_fd, buf, BLOCK_SIZE, (off_t)n_block * BLOCK_SIZE) != BLOCK_SIZE)
+	{
+		fprintf(stderr, "can't write block %zu: %s\n", n_block, strerror(errno));
+	}
+	if(crc_fd >= 0)
+	{
+		uint32_t none = 0;
+		pwrite(crc_fd, &none, sizeof(uint32_t), n_block * sizeof(uint32_t));
+	}
+}
+
+/**
+	Set a block's bit in a bitmap. Returns whether it was set already. Safe to call from several threads at once
+**/
+static int test_and_set(unsigned char *bitmap, size_t n_block)
+{
+	unsigned char bit = 1 << (n_block % 8);
+	return (__atomic_fetch_or(&bitmap[n_block / 8], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/**
+	Check if a block's bit is set in a bitmap
+**/
+static int test_bit(const unsigned char *bitmap, size_t n_block)
+{
+	return (bitmap[n_block / 8] >> (n_block % 8)) & 1;
+}
+
+/**
+	Mark a block as used. If it already was, something else points to it too
+**/
+static void claim_block(size_t n_block)
+{
+	if(test_and_set(used_bitmap, n_block))
+	{
+		test_and_set(dup_bitmap, n_block);
+		__atomic_store_n(&found_dups, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_fetch_add(&num_used, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+	Run task(0) to task(count - 1) on up to num_threads threads, this one included. Returns once they're all done
+**/
+static void run_parallel(void (*task)(size_t), size_t count)
+{
+	struct task_pool pool = { task, count, 0 };
+	pthread_t threads[MAX_THREADS];
+	size_t started = 0;
+	while(started + 1 < num_threads && started + 1 < count)
+	{
+		if(pthread_create(&threads[started], NULL, pool_worker, &pool) != 0)
+		{
+			break;
+		}
+		started++;
+	}
+	pool_worker(&pool);
+	for(size_t i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/**
+	Run tasks from a struct task_pool until there are none left
+**/
+static void *pool_worker(void *arg)
+{
+	struct task_pool *pool = arg;
+	size_t i;
+	while((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+	{
+		pool->task(i);
+	}
+	return NULL;
+}
+
+/**
+	Check the root's fields and drop directories that don't point to a block on the disk
+**/
+static void check_root(void)
+{
+	if(root.num_directories > MAX_DIRS_IN_ROOT)
+	{
+		problem(1, "root has %zu directories, at most %zu fit", root.num_directories, MAX_DIRS_IN_ROOT);
+		root.num_directories = MAX_DIRS_IN_ROOT;
+		root_dirty = 1;
+	}
+
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		struct cs1550_directory *dir = &root.directories[i];
+		if(dir->dname[MAX_FILENAME] != '\0')
+		{
+			problem(1, "directory name %.*s isn't terminated", MAX_FILENAME, dir->dname);
+			dir->dname[MAX_FILENAME] = '\0';
+			root_dirty = 1;
+		}
+		if(dir->n_start_block == 0 || dir->n_start_block >= total_blocks)
+		{
+			problem(1, "directory %s points to block %zu, outside the disk", dir->dname, dir->n_start_block);
+			remove_directory(i--);
+		}
+	}
+}
+
+/**
+	Check every directory in the root and everything in them, marking the blocks they use, and build our copy of
+	their trees. Every block of a directory's B-tree, and every directory nested in it, is a task of its own, so a
+	single big directory is checked on every thread
+**/
+static void walk_directories(void)
+{
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		free_tree(&dirs[i]);
+		if(root.directories[i].dname[0] != SNAPSHOT_PREFIX)
+		{
+			queue_dir_block(i, root.directories[i].dname, root.directories[i].n_start_block, 0, 0, NULL, NULL, NULL, 0, 0);
+		}
+	}
+
+	pthread_t threads[MAX_THREADS];
+	size_t started = 0;
+	while(started + 1 < num_threads)
+	{
+		if(pthread_create(&threads[started], NULL, walk_worker, NULL) != 0)
+		{
+			break;
+		}
+		started++;
+	}
+	walk_worker(NULL);
+	for(size_t i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	//Blocks were added as threads got to them, so put each tree in an order that doesn't depend on that
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		if(dirs[i].top)
+		{
+			order_tree(&dirs[i], dirs[i].top);
+		}
+	}
+}
+
+/**
+	Check queued directory blocks until there are none left and none being checked, since checking one can
+	queue more
+**/
+static void *walk_worker(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&dir_task_lock);
+	for(;;)
+	{
+		while(!dir_tasks && dir_tasks_left > 0)
+		{
+			pthread_cond_wait(&dir_task_cond, &dir_task_lock);
+		}
+		struct dir_task *task = dir_tasks;
+		if(!task)
+		{
+			break;
+		}
+		dir_tasks = task->next;
+		pthread_mutex_unlock(&dir_task_lock);
+
+		check_dir_block(task);
+		free(task->dname);
+		free(task);
+
+		pthread_mutex_lock(&dir_task_lock);
+		if(--dir_tasks_left == 0)
+		{
+			pthread_cond_broadcast(&dir_task_cond);
+		}
+	}
+	pthread_mutex_unlock(&dir_task_lock);
+	return NULL;
+}
+
+/**
+	Queue a block of the B-tree of directory `dname`, which is directory i of the root or nested in it, to be
+	checked(See check_dir_block). `parent` and `slot` say what points to it(See struct dir_rec). The first block
+	of a nested directory is claimed by whoever queues it. `again` is set when the block is in a directory that
+	was already reached through another entry, so its files aren't counted twice
+**/
+static void queue_dir_block(size_t i, const char *dname, size_t n_block, size_t depth, size_t nesting, const struct cs1550_dir_key *low, const struct cs1550_dir_key *high, struct dir_rec *parent, size_t slot, int again)
+{
+	struct dir_task *task = calloc(1, sizeof(struct dir_task));
+	task->i = i;
+	task->dname = strdup(dname);
+	task->n_block = n_block;
+	task->depth = depth;
+	task->nesting = nesting;
+	task->has_low = low != NULL;
+	task->has_high = high != NULL;
+	if(low)
+	{
+		task->low = *low;
+	}
+	if(high)
+	{
+		task->high = *high;
+	}
+	task->parent = parent;
+	task->slot = slot;
+	task->claimed = parent && depth == 0;
+	task->again = again;
+
+	pthread_mutex_lock(&dir_task_lock);
+	task->next = dir_tasks;
+	dir_tasks = task;
+	dir_tasks_left++;
+	pthread_cond_signal(&dir_task_cond);
+	pthread_mutex_unlock(&dir_task_lock);
+}
+
+/**
+	Check a block of a directory's B-tree(A struct dir_task), and queue the blocks below it. A node that doesn't
+	make sense can't be fixed, since there's no telling what was under it. Files out of place in a directory block
+	are what's left behind when splitting one is cut short, so they're dropped. Directories nested in it are
+	checked the same way, and nesting counts how deep they are
+**/
+static void check_dir_block(struct dir_task *task)
+{
+	const char *dname = task->dname;
+	size_t n_block = task->n_block;
+	const struct cs1550_dir_key *low = task->has_low ? &task->low : NULL;
+	const struct cs1550_dir_key *high = task->has_high ? &task->high : NULL;
+	struct dir_rec *rec = calloc(1, sizeof(struct dir_rec));
+	if(!task->claimed)
+	{
+		claim_block(n_block);
+	}
+	read_block(n_block, &rec->block);
+	rec->n_block = n_block;
+	rec->parent = task->parent;
+	rec->slot = task->slot;
+
+	if(rec->block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		struct cs1550_dir_node *node = &rec->block.node;
+		size_t num_keys = node->num_keys & ~DIR_NODE_INTERIOR;
+		int bad = 0;
+		if(task->depth >= DIR_MAX_DEPTH || num_keys > MAX_KEYS_IN_DIR_NODE)
+		{
+			problem(0, "%s has a bad node at block %zu", dname, n_block);
+			bad = 1;
+		}
+		for(size_t k = 0; !bad && k <= num_keys; k++)
+		{
+			const struct cs1550_dir_key *child_low = k > 0 ? &node->keys[k - 1] : low;
+			if(k < num_keys && child_low && compare_key(node->keys[k].fname, node->keys[k].fext, child_low) <= 0)
+			{
+				problem(0, "%s has keys out of order at block %zu", dname, n_block);
+				bad = 1;
+			}
+			else if(node->children[k] == 0 || node->children[k] >= total_blocks)
+			{
+				problem(0, "%s has a node pointing to block %zu, outside the disk", dname, node->children[k]);
+				bad = 1;
+			}
+		}
+		if(bad)
+		{
+			__atomic_store_n(&tree_damaged, 1, __ATOMIC_RELAXED);
+			free(rec);
+			return;
+		}
+
+		rec->dname = strdup(dname);
+		add_rec(task->i, rec);
+		for(size_t k = 0; k <= num_keys; k++)
+		{
+			const struct cs1550_dir_key *child_low = k > 0 ? &node->keys[k - 1] : low;
+			const struct cs1550_dir_key *child_high = k < num_keys ? &node->keys[k] : high;
+			queue_dir_block(task->i, dname, node->children[k], task->depth + 1, task->nesting, child_low, child_high, rec, k, task->again);
+		}
+		return;
+	}
+
+	//The record goes in the tree now so directories nested in this block can hang off it. Nothing reads it until
+	//every block has been checked
+	rec->dname = strdup(dname);
+	add_rec(task->i, rec);
+
+	struct cs1550_directory_entry *dir = &rec->block.dir;
+	int dir_dirty = 0;
+	if(dir->num_files > MAX_FILES_IN_DIR)
+	{
+		problem(1, "%s has %zu files in block %zu, at most %zu fit", dname, dir->num_files, n_block, MAX_FILES_IN_DIR);
+		dir->num_files = MAX_FILES_IN_DIR;
+		dir_dirty = 1;
+	}
+
+	struct cs1550_index_block index;
+	for(size_t j = 0; j < dir->num_files; j++)
+	{
+		struct cs1550_file_entry *file = &dir->files[j];
+		if(file->fname[MAX_FILENAME] != '\0' || file->fext[MAX_EXTENSION] != '\0')
+		{
+			problem(1, "file name in %s isn't terminated", dname);
+			file->fname[MAX_FILENAME] = '\0';
+			file->fext[MAX_EXTENSION] = '\0';
+			dir_dirty = 1;
+		}
+
+		//A file lookups would never find is a copy of one that's where it belongs, and a file without an
+		//index block can't be read, so both go
+		int out_of_place = (low && compare_key(file->fname, file->fext, low) < 0) || (high && compare_key(file->fname, file->fext, high) >= 0);
+		if(out_of_place || file->n_index_block == 0 || file->n_index_block >= total_blocks)
+		{
+			if(out_of_place)
+			{
+				problem(1, "%s/%s.%s is out of place in block %zu", dname, file->fname, file->fext, n_block);
+			}
+			else
+			{
+				problem(1, "%s/%s.%s has index block %zu, outside the disk", dname, file->fname, file->fext, file->n_index_block);
+			}
+			memmove(file, file + 1, (dir->num_files - j - 1) * sizeof(struct cs1550_file_entry));
+			dir->num_files--;
+			memset(&dir->files[dir->num_files], 0, sizeof(struct cs1550_file_entry));
+			j--;
+			dir_dirty = 1;
+			continue;
+		}
+
+		//A directory nested in this one is checked the same way, and its blocks count as part of directory i.
+		//One whose first block is a block of a directory it's in leads back up the tree, so it's dropped along
+		//with any nested deeper than a path can go. One that's already been reached through another entry is
+		//checked again, so which entry keeps it can be decided in name order(See resolve_duplicates), but only
+		//once more, so entries that all lead to the same directory can't have it checked over and over. Entries
+		//are only ever removed from here on, so the slot it's queued with stays right
+		if(file->fsize & FILE_IS_DIRECTORY)
+		{
+			char sub[MAX_DIR_PATH + 1];
+			snprintf(sub, sizeof(sub), "%s/%s%s%s", dname, file->fname, file->fext[0] ? "." : "", file->fext);
+			int too_deep = task->nesting + 1 >= MAX_PATH_DEPTH;
+			int loops = 0;
+			for(struct dir_rec *up = rec; up && !loops; up = up->parent)
+			{
+				loops = up->n_block == file->n_index_block;
+			}
+			int again = !too_deep && !loops && test_and_set(used_bitmap, file->n_index_block);
+			if(too_deep || loops || (again && test_and_set(dup_bitmap, file->n_index_block)))
+			{
+				if(too_deep)
+				{
+					problem(1, "%s is nested too deep", sub);
+				}
+				else if(loops)
+				{
+					problem(1, "%s starts at block %zu, which is a directory it's in", sub, file->n_index_block);
+				}
+				else
+				{
+					problem(1, "%s starts at block %zu, which is already in use", sub, file->n_index_block);
+				}
+				memmove(file, file + 1, (dir->num_files - j - 1) * sizeof(struct cs1550_file_entry));
+				dir->num_files--;
+				memset(&dir->files[dir->num_files], 0, sizeof(struct cs1550_file_entry));
+				j--;
+				dir_dirty = 1;
+				continue;
+			}
+			if(again)
+			{
+				__atomic_store_n(&found_dups, 1, __ATOMIC_RELAXED);
+			}
+			else
+			{
+				__atomic_fetch_add(&num_used, 1, __ATOMIC_RELAXED);
+			}
+			if(!task->again)
+			{
+				__atomic_fetch_add(&num_dirs, 1, __ATOMIC_RELAXED);
+			}
+			queue_dir_block(task->i, sub, file->n_index_block, 0, task->nesting + 1, NULL, NULL, rec, j, task->again || again);
+			continue;
+		}
+
+		if(file->fsize > MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE)
+		{
+			problem(1, "%s/%s.%s is %zu bytes, more than a file can hold", dname, file->fname, file->fext, file->fsize);
+			file->fsize = MAX_ENTRIES_IN_INDEX_BLOCK * BLOCK_SIZE;
+			dir_dirty = 1;
+		}
+
+		if(!task->again)
+		{
+			__atomic_fetch_add(&num_files, 1, __ATOMIC_RELAXED);
+		}
+		claim_block(file->n_index_block);
+		read_block(file->n_index_block, &index);
+		int index_dirty = 0;
+		for(size_t k = 0; k < MAX_ENTRIES_IN_INDEX_BLOCK; k++)
+		{
+			if(index.entries[k] == 0)
+			{
+				continue;
+			}
+			//A data block outside the disk becomes a hole
+			if(index.entries[k] >= total_blocks)
+			{
+				problem(1, "%s/%s.%s has data block %zu, outside the disk", dname, file->fname, file->fext, index.entries[k]);
+				index.entries[k] = 0;
+				index_dirty = 1;
+				continue;
+			}
+			claim_block(index.entries[k]);
+		}
+		if(repair && index_dirty)
+		{
+			write_block(file->n_index_block, &index);
+		}
+	}
+
+	if(repair && dir_dirty)
+	{
+		write_block(n_block, dir);
+	}
+}
+
+/**
+	Add a block to our copy of directory i's tree, under its parent if it has one
+**/
+static void add_rec(size_t i, struct dir_rec *rec)
+{
+	pthread_mutex_lock(&tree_lock);
+	if(rec->parent)
+	{
+		rec->next = rec->parent->children;
+		rec->parent->children = rec;
+	}
+	else
+	{
+		dirs[i].top = rec;
+	}
+	pthread_mutex_unlock(&tree_lock);
+}
+
+/**
+	Put the blocks below `rec` in the order of their slots and add them all to the tree's order after it.
+	Children come in slot order, which is name order both for a node's children and for a block's entries
+**/
+static void order_tree(struct dir_tree *tree, struct dir_rec *rec)
+{
+	tree->order = realloc(tree->order, (tree->num_order + 1) * sizeof(struct dir_rec *));
+	tree->order[tree->num_order++] = rec;
+
+	size_t num_children = 0;
+	for(struct dir_rec *child = rec->children; child; child = child->next)
+	{
+		num_children++;
+	}
+	if(num_children == 0)
+	{
+		return;
+	}
+	struct dir_rec **children = malloc(num_children * sizeof(struct dir_rec *));
+	size_t n = 0;
+	for(struct dir_rec *child = rec->children; child; child = child->next)
+	{
+		children[n++] = child;
+	}
+	qsort(children, num_children, sizeof(struct dir_rec *), compare_slot);
+	rec->children = children[0];
+	for(size_t k = 0; k < num_children; k++)
+	{
+		children[k]->next = k + 1 < num_children ? children[k + 1] : NULL;
+	}
+	free(children);
+
+	for(struct dir_rec *child = rec->children; child; child = child->next)
+	{
+		order_tree(tree, child);
+	}
+}
+
+/**
+	Compare two blocks below the same one by their slot, for qsort
+**/
+static int compare_slot(const void *a, const void *b)
+{
+	const struct dir_rec *rec_a = *(struct dir_rec * const *)a;
+	const struct dir_rec *rec_b = *(struct dir_rec * const *)b;
+	return (rec_a->slot > rec_b->slot) - (rec_a->slot < rec_b->slot);
+}
+
+/**
+	Compare a file's name and extension against a key the way strcmp does, which is the order they're kept in
+**/
+static int compare_key(const char *fname, const char *fext, const struct cs1550_dir_key *key)
+{
+	int cmp = strncmp(fname, key->fname, (MAX_FILENAME + 1));
+	if(cmp != 0)
+	{
+		return cmp;
+	}
+	return strncmp(fext, key->fext, (MAX_EXTENSION + 1));
+}
+
+/**
+	Check snapshot i of the root, if it is one, marking every block it uses. Snapshots are frozen, so problems in
+	them are only reported
+**/
+static void check_snapshot(size_t i)
+{
+	const char *name = root.directories[i].dname;
+	if(name[0] != SNAPSHOT_PREFIX)
+	{
+		return;
+	}
+
+	struct cs1550_root_directory tree;
+	test_and_set(snapshot_bitmap, root.directories[i].n_start_block);
+	read_block(root.directories[i].n_start_block, &tree);
+	if(tree.num_directories > MAX_DIRS_IN_ROOT)
+	{
+		problem(0, "snapshot %s has %zu directories, at most %zu fit", name, tree.num_directories, MAX_DIRS_IN_ROOT);
+		tree.num_directories = MAX_DIRS_IN_ROOT;
+	}
+
+	for(size_t j = 0; j < tree.num_directories; j++)
+	{
+		size_t n_dir_block = tree.directories[j].n_start_block;
+		char dname[MAX_FILENAME + 1];
+		snprintf(dname, sizeof(dname), "%.*s", MAX_FILENAME, tree.directories[j].dname);
+		if(n_dir_block == 0 || n_dir_block >= total_blocks)
+		{
+			problem(0, "snapshot %s: directory %s points to block %zu, outside the disk", name, dname, n_dir_block);
+			continue;
+		}
+		check_snapshot_block(name, dname, n_dir_block, 0, 0);
+	}
+}
+
+/**
+	Mark a block of a snapshot's directory and everything below it, nested directories included, as used by the
+	snapshot. A nested directory whose first block is already marked was either checked through another snapshot,
+	or is an entry leading back up the tree
+**/
+static void check_snapshot_block(const char *name, const char *dname, size_t n_block, size_t depth, size_t nesting)
+{
+	union
+	{
+		struct cs1550_dir_node node;
+		struct cs1550_directory_entry dir;
+	} block;
+	test_and_set(snapshot_bitmap, n_block);
+	read_block(n_block, &block);
+
+	if(block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		size_t num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+		if(depth >= DIR_MAX_DEPTH || num_keys > MAX_KEYS_IN_DIR_NODE)
+		{
+			problem(0, "snapshot %s: %s has a bad node at block %zu", name, dname, n_block);
+			return;
+		}
+		for(size_t k = 0; k <= num_keys; k++)
+		{
+			size_t n_child = block.node.children[k];
+			if(n_child == 0 || n_child >= total_blocks)
+			{
+				problem(0, "snapshot %s: %s has a node pointing to block %zu, outside the disk", name, dname, n_child);
+				continue;
+			}
+			check_snapshot_block(name, dname, n_child, depth + 1, nesting);
+		}
+		return;
+	}
+
+	struct cs1550_directory_entry *dir = &block.dir;
+	if(dir->num_files > MAX_FILES_IN_DIR)
+	{
+		problem(0, "snapshot %s: %s has %zu files in block %zu, at most %zu fit", name, dname, dir->num_files, n_block, MAX_FILES_IN_DIR);
+		dir->num_files = MAX_FILES_IN_DIR;
+	}
+
+	struct cs1550_index_block index;
+	for(size_t k = 0; k < dir->num_files; k++)
+	{
+		if(dir->files[k].n_index_block == 0 || dir->files[k].n_index_block >= total_blocks)
+		{
+			problem(0, "snapshot %s: a file in %s has index block %zu, outside the disk", name, dname, dir->files[k].n_index_block);
+			continue;
+		}
+		if(dir->files[k].fsize & FILE_IS_DIRECTORY)
+		{
+			char sub[MAX_DIR_PATH + 1];
+			snprintf(sub, sizeof(sub), "%s/%s%s%s", dname, dir->files[k].fname, dir->files[k].fext[0] ? "." : "", dir->files[k].fext);
+			if(nesting + 1 < MAX_PATH_DEPTH && !test_bit(snapshot_bitmap, dir->files[k].n_index_block))
+			{
+				check_snapshot_block(name, sub, dir->files[k].n_index_block, 0, nesting + 1);
+			}
+			continue;
+		}
+		test_and_set(snapshot_bitmap, dir->files[k].n_index_block);
+		read_block(dir->files[k].n_index_block, &index);
+		for(size_t l = 0; l < MAX_ENTRIES_IN_INDEX_BLOCK; l++)
+		{
+			if(index.entries[l] != 0 && index.entries[l] < total_blocks)
+			{
+				test_and_set(snapshot_bitmap, index.entries[l]);
+			}
+		}
+	}
+}
+
+/**
+	Decide who keeps each block that more than one thing points to. Blocks go to the first directory, then
+	index block, then data block to claim them, in that order, and within a directory to the first block in name
+	order. Whatever points to a directory block someone else has is dropped: the node's child or the entry of the
+	directory nested there, or the directory itself if it's its first block. Everything below goes with it. A
+	file that points to an index block someone else has is dropped, and a data block that's shared is copied so
+	each file has its own
+**/
+static void resolve_duplicates(void)
+{
+	unsigned char *claimed = calloc((total_blocks + 7) / 8, 1);
+	test_and_set(claimed, 0);
+
+	//Parents come before the blocks below them, so by the time a block is looked at, it's known whether it's
+	//still in the tree
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		struct dir_tree *tree = &dirs[i];
+		if(root.directories[i].dname[0] == SNAPSHOT_PREFIX)
+		{
+			continue;
+		}
+		int removed = 0;
+		for(size_t o = 0; o < tree->num_order && !removed; o++)
+		{
+			struct dir_rec *rec = tree->order[o];
+			if(rec->parent && rec->parent->dropped)
+			{
+				rec->dropped = 1;
+				continue;
+			}
+			if(!test_bit(dup_bitmap, rec->n_block) || !test_bit(claimed, rec->n_block))
+			{
+				test_and_set(claimed, rec->n_block);
+				continue;
+			}
+			if(!rec->parent)
+			{
+				problem(1, "directory %s shares block %zu", root.directories[i].dname, rec->n_block);
+				remove_directory(i--);
+				removed = 1;
+				continue;
+			}
+			problem(1, "%s shares block %zu", rec->dname, rec->n_block);
+			drop_rec(rec);
+		}
+		for(size_t o = 0; o < tree->num_order && !removed; o++)
+		{
+			compact_rec(tree->order[o]);
+		}
+	}
+
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		if(root.directories[i].dname[0] == SNAPSHOT_PREFIX)
+		{
+			continue;
+		}
+		for(size_t o = 0; o < dirs[i].num_order; o++)
+		{
+			struct dir_rec *rec = dirs[i].order[o];
+			if(rec->dropped || (rec->block.node.num_keys & DIR_NODE_INTERIOR))
+			{
+				continue;
+			}
+			struct cs1550_directory_entry *dir = &rec->block.dir;
+			int dir_dirty = 0;
+			for(size_t j = 0; j < dir->num_files; j++)
+			{
+				struct cs1550_file_entry *file = &dir->files[j];
+				if(file->fsize & FILE_IS_DIRECTORY)
+				{
+					continue;
+				}
+				if(test_bit(dup_bitmap, file->n_index_block) && test_and_set(claimed, file->n_index_block))
+				{
+					problem(1, "%s/%s.%s shares index block %zu", rec->dname, file->fname, file->fext, file->n_index_block);
+					memmove(file, file + 1, (dir->num_files - j - 1) * sizeof(struct cs1550_file_entry));
+					dir->num_files--;
+					memset(&dir->files[dir->num_files], 0, sizeof(struct cs1550_file_entry));
+					j--;
+					dir_dirty = 1;
+				}
+			}
+			if(repair && dir_dirty)
+			{
+				write_block(rec->n_block, dir);
+			}
+		}
+	}
+
+	struct cs1550_index_block index;
+	struct cs1550_data_block data;
+	for(size_t i = 0; i < root.num_directories; i++)
+	{
+		if(root.directories[i].dname[0] == SNAPSHOT_PREFIX)
+		{
+			continue;
+		}
+		for(size_t o = 0; o < dirs[i].num_order; o++)
+		{
+			struct dir_rec *rec = dirs[i].order[o];
+			if(rec->dropped || (rec->block.node.num_keys & DIR_NODE_INTERIOR))
+			{
+				continue;
+			}
+			struct cs1550_directory_entry *dir = &rec->block.dir;
+			for(size_t j = 0; j < dir->num_files; j++)
+			{
+				struct cs1550_file_entry *file = &dir->files[j];
+				if(file->fsize & FILE_IS_DIRECTORY)
+				{
+					continue;
+				}
+				int index_dirty = 0;
+				read_block(file->n_index_block, &index);
+				for(size_t k = 0; k < MAX_ENTRIES_IN_INDEX_BLOCK; k++)
+				{
+					size_t n_block = index.entries[k];
+					if(n_block == 0 || n_block >= total_blocks || !test_bit(dup_bitmap, n_block) || !test_and_set(claimed, n_block))
+					{
+						continue;
+					}
+
+					size_t n_copy = repair ? find_free_block() : 0;
+					problem(n_copy != 0 || !repair, "%s/%s.%s shares data block %zu", rec->dname, file->fname, file->fext, n_block);
+					if(n_copy != 0)
+					{
+						read_block(n_block, &data);
+						write_block(n_copy, &data);
+						index.entries[k] = n_copy;
+						index_dirty = 1;
+					}
+				}
+				if(repair && index_dirty)
+				{
+					write_block(file->n_index_block, &index);
+				}
+			}
+		}
+	}
+	free(claimed);
+}
+
+/**
+	Drop a block from our copy of its tree, along with everything below it. What points to it is cleared for now,
+	and removed by compact_rec once every block of the tree has been looked at, so the slots of the blocks after
+	it stay right until then. Its blocks are freed by the leak scan
+**/
+static void drop_rec(struct dir_rec *rec)
+{
+	struct dir_rec *parent = rec->parent;
+	rec->dropped = 1;
+	parent->dirty = 1;
+	if(parent->block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		parent->block.node.children[rec->slot] = 0;
+	}
+	else
+	{
+		parent->block.dir.files[rec->slot].n_index_block = 0;
+	}
+}
+
+/**
+	Remove what drop_rec cleared from a block and write it back. A node's child goes along with the key in
+	front of it, or the one after it if it's the first, so the children on either side take over its names. A
+	node left without children becomes an empty directory block
+**/
+static void compact_rec(struct dir_rec *rec)
+{
+	if(!rec->dirty || rec->dropped)
+	{
+		return;
+	}
+	if(rec->block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		struct cs1550_dir_node *node = &rec->block.node;
+		size_t num_keys = node->num_keys & ~DIR_NODE_INTERIOR;
+		for(size_t k = num_keys + 1; k-- > 0; )
+		{
+			if(node->children[k] != 0)
+			{
+				continue;
+			}
+			if(num_keys == 0)
+			{
+				memset(&rec->block, 0, sizeof(rec->block));
+				break;
+			}
+			size_t n_key = k > 0 ? k - 1 : 0;
+			memmove(&node->keys[n_key], &node->keys[n_key + 1], (num_keys - n_key - 1) * sizeof(struct cs1550_dir_key));
+			memmove(&node->children[k], &node->children[k + 1], (num_keys - k) * sizeof(size_t));
+			num_keys--;
+			memset(&node->keys[num_keys], 0, sizeof(struct cs1550_dir_key));
+			node->children[num_keys + 1] = 0;
+			node->num_keys = num_keys | DIR_NODE_INTERIOR;
+		}
+	}
+	else
+	{
+		struct cs1550_directory_entry *dir = &rec->block.dir;
+		for(size_t j = 0; j < dir->num_files; j++)
+		{
+			if(dir->files[j].n_index_block == 0)
+			{
+				memmove(&dir->files[j], &dir->files[j + 1], (dir->num_files - j - 1) * sizeof(struct cs1550_file_entry));
+				dir->num_files--;
+				memset(&dir->files[dir->num_files], 0, sizeof(struct cs1550_file_entry));
+				j--;
+			}
+		}
+	}
+	if(repair)
+	{
+		write_block(rec->n_block, &rec->block);
+	}
+}
+
+/**
+	Find a block nothing points to and mark it used. Returns 0 if the disk is full
+**/
+static size_t find_free_block(void)
+{
+	for(size_t n_block = 1; n_block < total_blocks; n_block++)
+	{
+		if(!test_bit(snapshot_bitmap, n_block) && !test_and_set(used_bitmap, n_block))
+		{
+			return n_block;
+		}
+	}
+	return 0;
+}
+
+/**
+	Drop directory i from the root. Its files go with it, and their blocks are freed by the leak scan
+**/
+static void remove_directory(size_t i)
+{
+	free_tree(&dirs[i]);
+	memmove(&root.directories[i], &root.directories[i + 1], (root.num_directories - i - 1) * sizeof(struct cs1550_directory));
+	memmove(&dirs[i], &dirs[i + 1], (root.num_directories - i - 1) * sizeof(struct dir_tree));
+	root.num_directories--;
+	memset(&dirs[root.num_directories], 0, sizeof(struct dir_tree));
+	root_dirty = 1;
+}
+
+/**
+	Free our copy of a directory's B-tree and leave it empty
+**/
+static void free_tree(struct dir_tree *tree)
+{
+	if(tree->top)
+	{
+		free_rec(tree->top);
+	}
+	free(tree->order);
+	memset(tree, 0, sizeof(struct dir_tree));
+}
+
+/**
+	Free a block of our copy of a tree and everything below it
+**/
+static void free_rec(struct dir_rec *rec)
+{
+	struct dir_rec *child = rec->children;
+	while(child)
+	{
+		struct dir_rec *next = child->next;
+		free_rec(child);
+		child = next;
+	}
+	free(rec->dname);
+	free(rec);
+}
+
+/**
+	Look for leaked blocks in one chunk of the disk: blocks nothing points to that aren't zero. Holes are
+	skipped without being read, so a sparse image is scanned quickly. With -r they're punched out
+**/
+static void scan_chunk(size_t chunk)
+{
+	off_t start = (off_t)chunk * SCAN_CHUNK_BLOCKS * BLOCK_SIZE;
+	off_t end = start + (off_t)SCAN_CHUNK_BLOCKS * BLOCK_SIZE;
+	off_t disk_end = (off_t)total_blocks * BLOCK_SIZE;
+	if(end > disk_end)
+	{
+		end = disk_end;
+	}
+
+	unsigned char *buf = malloc(SCAN_READ_BLOCKS * BLOCK_SIZE);
+	size_t leaked = 0;
+	off_t pos = start;
+	while(pos < end)
+	{
+		//Jump to the next stretch of data. If the host can't tell us where that is, read everything
+		off_t data = lseek(disk_fd, pos, SEEK_DATA);
+		off_t hole = end;
+		if(data < 0 && errno == ENXIO)
+		{
+			break;
+		}
+		if(data >= 0)
+		{
+			if(data >= end)
+			{
+				break;
+			}
+			pos = data - data % BLOCK_SIZE;
+			hole = lseek(disk_fd, data, SEEK_HOLE);
+			if(hole < 0 || hole > end)
+			{
+				hole = end;
+			}
+		}
+
+		while(pos < hole)
+		{
+			size_t count = (hole - pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			if(count > SCAN_READ_BLOCKS)
+			{
+				count = SCAN_READ_BLOCKS;
+			}
+			ssize_t res = pread(disk_fd, buf, count * BLOCK_SIZE, pos);
+			if(res <= 0)
+			{
+				pos = hole;
+				break;
+			}
+			if((size_t)res < count * BLOCK_SIZE)
+			{
+				memset(buf + res, 0, count * BLOCK_SIZE - res);
+			}
+
+			size_t first = pos / BLOCK_SIZE;
+			for(size_t i = 0; i < count; i++)
+			{
+				if(test_bit(used_bitmap, first + i) || test_bit(snapshot_bitmap, first + i) || is_zero(buf + i * BLOCK_SIZE, BLOCK_SIZE))
+				{
+					continue;
+				}
+				leaked++;
+				if(tree_damaged)
+				{
+					continue;
+				}
+				memset(buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+				if(repair && fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(first + i) * BLOCK_SIZE, BLOCK_SIZE) != 0)
+				{
+					write_block(first + i, buf + i * BLOCK_SIZE);
+				}
+				else if(repair && crc_fd >= 0)
+				{
+					uint32_t none = 0;
+					pwrite(crc_fd, &none, sizeof(uint32_t), (first + i) * sizeof(uint32_t));
+				}
+			}
+			pos += count * BLOCK_SIZE;
+		}
+	}
+	free(buf);
+	__atomic_fetch_add(&num_leaked, leaked, __ATOMIC_RELAXED);
+}
+
+/**
+	Check if a buffer is all zeros
+**/
+static int is_zero(const unsigned char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
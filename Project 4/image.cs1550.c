@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cs1550.h"
+
+//Helper functions
+static int export_image(const char *image);
+static int import_image(const char *image);
+static void read_block(size_t n_block, void *buf);
+static void mark_block(size_t n_block);
+static void mark_tree(size_t n_root);
+static void mark_dir_blocks(size_t n_block, size_t depth, size_t nesting);
+static int is_zero(const unsigned char *buf, size_t len);
+static int write_all(int fd, const void *buf, size_t len);
+static int read_all(int fd, void *buf, size_t len);
+
+//Entries in the root whose name starts with this are snapshots. They point to a frozen copy of the root
+#define SNAPSHOT_PREFIX '@'
+
+//Identifies a stream, and the version of its format
+#define STREAM_MAGIC "CS1550IM"
+#define STREAM_VERSION 1
+
+//Most blocks in one run of a stream. Longer runs are split
+#define STREAM_RUN_BLOCKS 256
+
+//Start of a stream. Numbers are in the same byte order as the disk itself
+struct stream_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	//Size of the image in blocks
+	uint64_t total_blocks;
+};
+
+//Start of a run of blocks, which are followed by their data. A run with no blocks ends the stream
+struct stream_run
+{
+	uint64_t n_block;
+	uint64_t count;
+};
+
+//The image being exported, its size in blocks, and the blocks its filesystem uses
+static int disk_fd;
+static size_t total_blocks;
+static unsigned char *used_bitmap;
+
+/*
+ * Copies a disk image to or from a stream: image.cs1550 export|import [IMAGE]
+ *
+ * export walks the filesystem on the image (.disk by default) the same way
+ * fsck does, and writes only the blocks it uses to standard output, as runs
+ * of consecutive blocks. Blocks that are in use but all zeros are skipped as
+ * well. A mostly empty image exports to a stream about the size of its data.
+ *
+ * import reads such a stream from standard input and writes it to a freshly
+ * formatted image of the original size. Everything the stream skipped is left
+ * as a hole. Like mkfs.cs1550, it removes any checksum file next to the image.
+ *
+ * Snapshots are exported along with everything else. Striped disks aren't
+ * supported. The image must not be mounted while it is exported or imported.
+ */
+int main(int argc, char *argv[])
+{
+	if(argc < 2 || argc > 3)
+	{
+		fprintf(stderr, "usage: %s export|import [IMAGE]\n", argv[0]);
+		return 2;
+	}
+	const char *image = argc == 3 ? argv[2] : ".disk";
+	if(strcmp(argv[1], "export") == 0)
+	{
+		return export_image(image);
+	}
+	if(strcmp(argv[1], "import") == 0)
+	{
+		return import_image(image);
+	}
+	fprintf(stderr, "usage: %s export|import [IMAGE]\n", argv[0]);
+	return 2;
+}
+
+/**
+	Write every block of the image that its filesystem uses, and that isn't zero, to standard output
+**/
+static int export_image(const char *image)
+{
+	disk_fd = open(image, O_RDONLY);
+	if(disk_fd < 0)
+	{
+		fprintf(stderr, "export: can't open %s: %s\n", image, strerror(errno));
+		return 1;
+	}
+	total_blocks = lseek(disk_fd, 0, SEEK_END) / BLOCK_SIZE;
+	used_bitmap = calloc((total_blocks + 7) / 8, 1);
+
+	//An empty image has no root yet, so there's nothing to walk
+	if(total_blocks > 0)
+	{
+		mark_tree(0);
+	}
+
+	struct stream_header header;
+	memset(&header, 0, sizeof(struct stream_header));
+	memcpy(header.magic, STREAM_MAGIC, sizeof(header.magic));
+	header.version = STREAM_VERSION;
+	header.block_size = BLOCK_SIZE;
+	header.total_blocks = total_blocks;
+	if(write_all(STDOUT_FILENO, &header, sizeof(struct stream_header)) != 0)
+	{
+		fprintf(stderr, "export: can't write the stream: %s\n", strerror(errno));
+		return 1;
+	}
+
+	//Gather consecutive blocks worth sending into runs
+	unsigned char *run = malloc(STREAM_RUN_BLOCKS * BLOCK_SIZE);
+	unsigned char block[BLOCK_SIZE];
+	struct stream_run head = { 0, 0 };
+	size_t num_exported = 0;
+	for(size_t n_block = 0; n_block <= total_blocks; n_block++)
+	{
+		int send = 0;
+		if(n_block < total_blocks && (used_bitmap[n_block / 8] >> (n_block % 8)) & 1)
+		{
+			read_block(n_block, block);
+			send = !is_zero(block, BLOCK_SIZE);
+		}
+
+		//Flush the run when it can't go on: the block isn't sent, it's full, or this is the end
+		if(head.count > 0 && (!send || head.count == STREAM_RUN_BLOCKS))
+		{
+			if(write_all(STDOUT_FILENO, &head, sizeof(struct stream_run)) != 0 || write_all(STDOUT_FILENO, run, head.count * BLOCK_SIZE) != 0)
+			{
+				fprintf(stderr, "export: can't write the stream: %s\n", strerror(errno));
+				free(run);
+				return 1;
+			}
+			num_exported += head.count;
+			head.count = 0;
+		}
+		if(send)
+		{
+			if(head.count == 0)
+			{
+				head.n_block = n_block;
+			}
+			memcpy(run + head.count * BLOCK_SIZE, block, BLOCK_SIZE);
+			head.count++;
+		}
+	}
+	free(run);
+
+	struct stream_run end = { total_blocks, 0 };
+	if(write_all(STDOUT_FILENO, &end, sizeof(struct stream_run)) != 0)
+	{
+		fprintf(stderr, "export: can't write the stream: %s\n", strerror(errno));
+		return 1;
+	}
+	close(disk_fd);
+	free(used_bitmap);
+	fprintf(stderr, "%s: exported %zu of %zu blocks\n", image, num_exported, total_blocks);
+	return 0;
+}
+
+/**
+	Format the image with the size a stream on standard input gives, and write the stream's blocks into it
+**/
+static int import_image(const char *image)
+{
+	struct stream_header header;
+	if(read_all(STDIN_FILENO, &header, sizeof(struct stream_header)) != 0 || memcmp(header.magic, STREAM_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "import: the input isn't an exported image\n");
+		return 1;
+	}
+	if(header.version != STREAM_VERSION || header.block_size != BLOCK_SIZE)
+	{
+		fprintf(stderr, "import: the image was exported with version %u and %u byte blocks\n", header.version, header.block_size);
+		return 1;
+	}
+
+	int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		fprintf(stderr, "import: can't open %s: %s\n", image, strerror(errno));
+		return 1;
+	}
+	if(ftruncate(fd, (off_t)header.total_blocks * BLOCK_SIZE) != 0)
+	{
+		fprintf(stderr, "import: can't size %s: %s\n", image, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	//Checksums kept for whatever was on the image before would no longer match anything
+	char crc_path[4096];
+	snprintf(crc_path, sizeof(crc_path), "%s.crc", image);
+	if(unlink(crc_path) != 0 && errno != ENOENT)
+	{
+		fprintf(stderr, "import: can't remove %s: %s\n", crc_path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	unsigned char *run = malloc(STREAM_RUN_BLOCKS * BLOCK_SIZE);
+	size_t num_imported = 0;
+	for(;;)
+	{
+		struct stream_run head;
+		if(read_all(STDIN_FILENO, &head, sizeof(struct stream_run)) != 0)
+		{
+			fprintf(stderr, "import: the stream ends too early\n");
+			break;
+		}
+		if(head.count == 0)
+		{
+			free(run);
+			if(fsync(fd) != 0)
+			{
+				fprintf(stderr, "import: can't write %s: %s\n", image, strerror(errno));
+				close(fd);
+				return 1;
+			}
+			close(fd);
+			fprintf(stderr, "%s: imported %zu of %zu blocks\n", image, num_imported, (size_t)header.total_blocks);
+			return 0;
+		}
+		if(head.count > STREAM_RUN_BLOCKS || head.n_block >= header.total_blocks || head.count > header.total_blocks - head.n_block)
+		{
+			fprintf(stderr, "import: the stream has a bad run of %zu blocks at block %zu\n", (size_t)head.count, (size_t)head.n_block);
+			break;
+		}
+		if(read_all(STDIN_FILENO, run, head.count * BLOCK_SIZE) != 0)
+		{
+			fprintf(stderr, "import: the stream ends too early\n");
+			break;
+		}
+		if(pwrite(fd, run, head.count * BLOCK_SIZE, (off_t)head.n_block * BLOCK_SIZE) != (ssize_t)(head.count * BLOCK_SIZE))
+		{
+			fprintf(stderr, "import: can't write %s: %s\n", image, strerror(errno));
+			break;
+		}
+		num_imported += head.count;
+	}
+
+	//A partial image is worse than none, since it would mount
+	free(run);
+	close(fd);
+	unlink(image);
+	return 1;
+}
+
+/**
+	Read a block from the image. Anything past its end reads as zeros
+**/
+static void read_block(size_t n_block, void *buf)
+{
+	ssize_t res = pread(disk_fd, buf, BLOCK_SIZE, (off_t)n_block * BLOCK_SIZE);
+	if(res < BLOCK_SIZE)
+	{
+		memset((char*)buf + (res > 0 ? res : 0), 0, BLOCK_SIZE - (res > 0 ? res : 0));
+	}
+}
+
+/**
+	Mark a block as used by the filesystem. Blocks outside the image are ignored
+**/
+static void mark_block(size_t n_block)
+{
+	if(n_block < total_blocks)
+	{
+		used_bitmap[n_block / 8] |= 1 << (n_block % 8);
+	}
+}
+
+/**
+	Mark a root and everything it points to: its directories' blocks and their files' index and data blocks. The
+	live root also leads to every snapshot's copy of the root
+**/
+static void mark_tree(size_t n_root)
+{
+	struct cs1550_root_directory tree;
+	mark_block(n_root);
+	read_block(n_root, &tree);
+	for(size_t i = 0; i < tree.num_directories && i < MAX_DIRS_IN_ROOT; i++)
+	{
+		size_t n_block = tree.directories[i].n_start_block;
+		if(n_block == 0 || n_block >= total_blocks)
+		{
+			continue;
+		}
+		if(tree.directories[i].dname[0] == SNAPSHOT_PREFIX)
+		{
+			//Snapshots only hang off the live root
+			if(n_root == 0)
+			{
+				mark_tree(n_block);
+			}
+			continue;
+		}
+		mark_dir_blocks(n_block, 0, 0);
+	}
+}
+
+/**
+	Mark a block of a directory's B-tree and everything below it, directories nested in it included. depth is how
+	many nodes are above it and nesting how many directories, so a corrupt node can't send us around in circles
+**/
+static void mark_dir_blocks(size_t n_block, size_t depth, size_t nesting)
+{
+	union
+	{
+		struct cs1550_dir_node node;
+		struct cs1550_directory_entry dir;
+	} block;
+	mark_block(n_block);
+	read_block(n_block, &block);
+
+	if(block.node.num_keys & DIR_NODE_INTERIOR)
+	{
+		size_t num_keys = block.node.num_keys & ~DIR_NODE_INTERIOR;
+		if(depth >= DIR_MAX_DEPTH || num_keys > MAX_KEYS_IN_DIR_NODE)
+		{
+			return;
+		}
+		for(size_t i = 0; i <= num_keys; i++)
+		{
+			if(block.node.children[i] != 0 && block.node.children[i] < total_blocks)
+			{
+				mark_dir_blocks(block.node.children[i], depth + 1, nesting);
+			}
+		}
+		return;
+	}
+
+	struct cs1550_index_block index;
+	for(size_t i = 0; i < block.dir.num_files && i < MAX_FILES_IN_DIR; i++)
+	{
+		size_t n_index_block = block.dir.files[i].n_index_block;
+		if(n_index_block == 0 || n_index_block >= total_blocks)
+		{
+			continue;
+		}
+
+		//A nested directory already marked is shared with a snapshot, which brought its blocks along
+		if(block.dir.files[i].fsize & FILE_IS_DIRECTORY)
+		{
+			if(nesting + 1 < MAX_PATH_DEPTH && !(used_bitmap[n_index_block / 8] & (1 << (n_index_block % 8))))
+			{
+				mark_dir_blocks(n_index_block, 0, nesting + 1);
+			}
+			continue;
+		}
+		mark_block(n_index_block);
+		read_block(n_index_block, &index);
+		for(size_t j = 0; j < MAX_ENTRIES_IN_INDEX_BLOCK; j++)
+		{
+			if(index.entries[j] != 0)
+			{
+				mark_block(index.entries[j]);
+			}
+		}
+	}
+}
+
+/**
+	Check if a buffer is all zeros
+**/
+static int is_zero(const unsigned char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/**
+	Write all of buf to fd, however many writes it takes. Returns 0, or -1 if a write fails
+**/
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	while(len > 0)
+	{
+		ssize_t res = write(fd, pos, len);
+		if(res < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(res <= 0)
+		{
+			return -1;
+		}
+		pos += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/**
+	Read exactly len bytes from fd into buf. Returns 0, or -1 if the input ends first or a read fails
+**/
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	while(len > 0)
+	{
+		ssize_t res = read(fd, pos, len);
+		if(res < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(res <= 0)
+		{
+			return -1;
+		}
+		pos += res;
+		len -= res;
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cs1550.h"
+
+static size_t parse_size(const char *str);
+
+/*
+ * Formats a disk image: mkfs.cs1550 [-s SIZE] [IMAGE]
+ *
+ * The image (.disk by default) is replaced by an empty filesystem, which is
+ * just a zeroed root block. The rest of the image is left as a hole, so a
+ * large SIZE costs nothing on the host until blocks are written. Without -s,
+ * the image is one block long and grows as the filesystem is used. Any
+ * checksum file left next to the image is removed along with the old data.
+ */
+int main(int argc, char *argv[])
+{
+	size_t size = BLOCK_SIZE;
+	int opt;
+	while((opt = getopt(argc, argv, "s:")) != -1)
+	{
+		switch(opt)
+		{
+			case 's':
+				size = parse_size(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s SIZE] [IMAGE]\n", argv[0]);
+				return 2;
+		}
+	}
+	const char *image = optind < argc ? argv[optind] : ".disk";
+
+	//The image has to hold at least the root, and only whole blocks are used
+	size -= size % BLOCK_SIZE;
+	if(size < BLOCK_SIZE)
+	{
+		fprintf(stderr, "%s: the image must be at least %d bytes\n", argv[0], BLOCK_SIZE);
+		return 2;
+	}
+
+	int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		fprintf(stderr, "%s: can't open %s: %s\n", argv[0], image, strerror(errno));
+		return 1;
+	}
+
+	//Truncating dropped whatever was there before, so every block, the root included, is a zeroed hole
+	if(ftruncate(fd, size) != 0 || fsync(fd) != 0)
+	{
+		fprintf(stderr, "%s: can't format %s: %s\n", argv[0], image, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	//Checksums kept for the old filesystem with -o checksum would no longer match anything
+	char crc_path[4096];
+	snprintf(crc_path, sizeof(crc_path), "%s.crc", image);
+	if(unlink(crc_path) != 0 && errno != ENOENT)
+	{
+		fprintf(stderr, "%s: can't remove %s: %s\n", argv[0], crc_path, strerror(errno));
+		return 1;
+	}
+
+	printf("%s: %zu blocks of %d bytes\n", image, size / BLOCK_SIZE, BLOCK_SIZE);
+	return 0;
+}
+
+/**
+	Parse a size in bytes with an optional K, M or G suffix, e.g. "512K" or "2G"
+**/
+static size_t parse_size(const char *str)
+{
+	char *suffix;
+	size_t size = strtoull(str, &suffix, 10);
+	switch(*suffix)
+	{
+		case 'G': case 'g':
+			size *= 1024;
+			//Fall through
+		case 'M': case 'm':
+			size *= 1024;
+			//Fall through
+		case 'K': case 'k':
+			size *= 1024;
+			break;
+	}
+	return size;
+}
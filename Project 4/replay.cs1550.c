@@ -0,0 +1,299 @@
+//The handlers are called directly, so they're built in without the daemon's main
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#include <stdlib.h>
+
+//Most bytes a single read or write in a trace can ask for
+#define MAX_IO_SIZE (1024 * 1024)
+
+//What replaying one kind of call cost
+struct op_stats
+{
+	uint64_t *latencies;
+	size_t count;
+	size_t capacity;
+	uint64_t bytes;
+};
+
+static const char *op_names[TRACE_NUM_OPS] = {
+	[TRACE_GETATTR] = "getattr",
+	[TRACE_READDIR] = "readdir",
+	[TRACE_MKDIR] = "mkdir",
+	[TRACE_RMDIR] = "rmdir",
+	[TRACE_READ] = "read",
+	[TRACE_WRITE] = "write",
+	[TRACE_MKNOD] = "mknod",
+	[TRACE_UNLINK] = "unlink",
+	[TRACE_RENAME] = "rename",
+	[TRACE_TRUNCATE] = "truncate",
+	[TRACE_FLUSH] = "flush",
+	[TRACE_FSYNC] = "fsync",
+	[TRACE_FALLOCATE] = "fallocate",
+	[TRACE_STATFS] = "statfs",
+	[TRACE_OPEN] = "open",
+};
+
+static int replay_call(const struct fuse_operations *oper, const struct trace_record *rec, const char *path, const char *path2, char *io_buf);
+static int count_entry(void *buf, const char *name, const struct stat *statbuf, off_t offset);
+static void add_latency(struct op_stats *stats, uint64_t latency);
+static int compare_latencies(const void *a, const void *b);
+static void print_stats(const char *name, struct op_stats *stats);
+
+/*
+ * Plays back a trace recorded with -o trace: replay.cs1550 [-r] [-o OPTIONS] TRACE
+ *
+ * Every call in the trace is made again, straight to the same handlers the
+ * daemon uses, against .disk (or the images given with -o stripe) without
+ * mounting anything. -o takes the same options as the daemon, so the same
+ * trace can be played back with and without, say, -o log to compare them.
+ * Start from a copy of the image as it was when the trace was recorded, or
+ * the calls won't do what they did then. Calls are made one after another
+ * as fast as they can be, or with -r, as far apart as they were recorded.
+ * Writes write a fixed pattern, since traces don't keep the data. With
+ * -o trace, the replay is recorded like the daemon would record it.
+ *
+ * Prints the number of calls, how long they took, the bytes read and
+ * written per second, and the mean, median, 99th percentile and slowest
+ * latency of each kind of call. Calls that returned something other than
+ * what they did when they were recorded are counted, since they mean the
+ * replay went down a different path.
+ */
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1)
+	{
+		return 2;
+	}
+	int realtime = 0;
+	const char *trace = NULL;
+	for(int i = 1; i < args.argc; i++)
+	{
+		if(strcmp(args.argv[i], "-r") == 0)
+		{
+			realtime = 1;
+		}
+		else if(args.argv[i][0] != '-' && !trace)
+		{
+			trace = args.argv[i];
+		}
+		else
+		{
+			trace = NULL;
+			break;
+		}
+	}
+	if(!trace)
+	{
+		fprintf(stderr, "usage: %s [-r] [-o OPTIONS] TRACE\n", argv[0]);
+		return 2;
+	}
+
+	FILE *in = fopen(trace, "rb");
+	if(!in)
+	{
+		fprintf(stderr, "%s: can't open %s: %s\n", argv[0], trace, strerror(errno));
+		return 1;
+	}
+	struct trace_header header;
+	if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION)
+	{
+		fprintf(stderr, "%s: %s is not a trace\n", argv[0], trace);
+		fclose(in);
+		return 1;
+	}
+
+	const struct fuse_operations *oper = options.trace ? &trace_oper : &cs1550_oper;
+	struct fuse_conn_info conn;
+	memset(&conn, 0, sizeof(conn));
+	oper->init(&conn);
+
+	//Written data is a pattern rather than zeros, so it isn't mistaken for holes
+	char *io_buf = malloc(MAX_IO_SIZE);
+	for(size_t i = 0; i < MAX_IO_SIZE; i++)
+	{
+		io_buf[i] = 'a' + i % 26;
+	}
+
+	struct op_stats stats[TRACE_NUM_OPS];
+	struct op_stats total;
+	memset(stats, 0, sizeof(stats));
+	memset(&total, 0, sizeof(total));
+	size_t num_differed = 0;
+	size_t num_skipped = 0;
+	char path[2 * 65536];
+	struct trace_record rec;
+	uint64_t start = trace_now();
+	while(fread(&rec, sizeof(rec), 1, in) == 1)
+	{
+		if(fread(path, 1, rec.path_len, in) != rec.path_len)
+		{
+			fprintf(stderr, "%s: %s is cut short\n", argv[0], trace);
+			break;
+		}
+		path[rec.path_len] = '\0';
+		//rename's second path follows the first after a 0 byte
+		size_t first_len = strlen(path);
+		const char *path2 = first_len < rec.path_len ? path + first_len + 1 : NULL;
+
+		if(rec.op == 0 || rec.op >= TRACE_NUM_OPS || ((rec.op == TRACE_READ || rec.op == TRACE_WRITE) && rec.size > MAX_IO_SIZE))
+		{
+			num_skipped++;
+			continue;
+		}
+
+		//Wait until as long after the start as the call was made when it was recorded
+		if(realtime)
+		{
+			uint64_t due = start + rec.time;
+			struct timespec ts = { due / 1000000000, due % 1000000000 };
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+
+		uint64_t before = trace_now();
+		int res = replay_call(oper, &rec, path, path2, io_buf);
+		uint64_t latency = trace_now() - before;
+
+		add_latency(&stats[rec.op], latency);
+		add_latency(&total, latency);
+		if((rec.op == TRACE_READ || rec.op == TRACE_WRITE) && res > 0)
+		{
+			stats[rec.op].bytes += res;
+			total.bytes += res;
+		}
+		num_differed += res != rec.result;
+	}
+	uint64_t elapsed = trace_now() - start;
+	fclose(in);
+
+	//Data still buffered is part of what the trace cost
+	uint64_t before = trace_now();
+	oper->destroy(NULL);
+	uint64_t unmount = trace_now() - before;
+	free(io_buf);
+
+	double seconds = elapsed / 1e9;
+	printf("%zu calls in %.3f s: %.0f calls/s, %.2f MB/s read and written\n", total.count, seconds, seconds > 0 ? total.count / seconds : 0, seconds > 0 ? total.bytes / seconds / (1024 * 1024) : 0);
+	printf("unmount took %.3f ms\n", unmount / 1e6);
+	if(num_differed != 0)
+	{
+		printf("%zu calls returned something other than when they were recorded\n", num_differed);
+	}
+	if(num_skipped != 0)
+	{
+		printf("%zu records were not understood and skipped\n", num_skipped);
+	}
+	printf("%-10s %10s %10s %10s %10s %10s\n", "call", "count", "mean ns", "p50 ns", "p99 ns", "max ns");
+	for(int op = 1; op < TRACE_NUM_OPS; op++)
+	{
+		print_stats(op_names[op], &stats[op]);
+	}
+	print_stats("all", &total);
+	return 0;
+}
+
+/**
+	Make the call a record describes through `oper` and return what the handler did
+**/
+static int replay_call(const struct fuse_operations *oper, const struct trace_record *rec, const char *path, const char *path2, char *io_buf)
+{
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	struct stat statbuf;
+	struct statvfs statvfsbuf;
+	size_t num_entries = 0;
+
+	switch(rec->op)
+	{
+		case TRACE_GETATTR:
+			return oper->getattr(path, &statbuf);
+		case TRACE_READDIR:
+			return oper->readdir(path, &num_entries, count_entry, rec->offset, &fi);
+		case TRACE_MKDIR:
+			return oper->mkdir(path, rec->arg);
+		case TRACE_RMDIR:
+			return oper->rmdir(path);
+		case TRACE_READ:
+			return oper->read(path, io_buf, rec->size, rec->offset, &fi);
+		case TRACE_WRITE:
+			return oper->write(path, io_buf, rec->size, rec->offset, &fi);
+		case TRACE_MKNOD:
+			return oper->mknod(path, rec->arg, 0);
+		case TRACE_UNLINK:
+			return oper->unlink(path);
+		case TRACE_RENAME:
+			return path2 ? oper->rename(path, path2) : -EINVAL;
+		case TRACE_TRUNCATE:
+			return oper->truncate(path, rec->size);
+		case TRACE_FLUSH:
+			return oper->flush(path, &fi);
+		case TRACE_FSYNC:
+			return oper->fsync(path, rec->arg, &fi);
+		case TRACE_FALLOCATE:
+			return oper->fallocate(path, rec->arg, rec->offset, rec->size, &fi);
+		case TRACE_STATFS:
+			return oper->statfs(path, &statvfsbuf);
+		case TRACE_OPEN:
+			fi.flags = rec->arg;
+			return oper->open(path, &fi);
+	}
+	return -ENOSYS;
+}
+
+/**
+	readdir's filler. Entries are only counted, there's nowhere for them to go
+**/
+static int count_entry(void *buf, const char *name, const struct stat *statbuf, off_t offset)
+{
+	(void) name;
+	(void) statbuf;
+	(void) offset;
+	(*(size_t*)buf)++;
+	return 0;
+}
+
+/**
+	Add how long a call took to the calls of its kind
+**/
+static void add_latency(struct op_stats *stats, uint64_t latency)
+{
+	if(stats->count == stats->capacity)
+	{
+		stats->capacity = stats->capacity ? stats->capacity * 2 : 1024;
+		stats->latencies = realloc(stats->latencies, stats->capacity * sizeof(uint64_t));
+	}
+	stats->latencies[stats->count++] = latency;
+}
+
+/**
+	Order latencies from fastest to slowest, for qsort
+**/
+static int compare_latencies(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+	Print a line of latencies for one kind of call, if there were any
+**/
+static void print_stats(const char *name, struct op_stats *stats)
+{
+	if(stats->count == 0)
+	{
+		return;
+	}
+	qsort(stats->latencies, stats->count, sizeof(uint64_t), compare_latencies);
+	uint64_t sum = 0;
+	for(size_t i = 0; i < stats->count; i++)
+	{
+		sum += stats->latencies[i];
+	}
+	printf("%-10s %10zu %10llu %10llu %10llu %10llu\n", name, stats->count, (unsigned long long)(sum / stats->count),
+		(unsigned long long)stats->latencies[stats->count / 2], (unsigned long long)stats->latencies[stats->count * 99 / 100],
+		(unsigned long long)stats->latencies[stats->count - 1]);
+	free(stats->latencies);
+	stats->latencies = NULL;
+}